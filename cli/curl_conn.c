@@ -9,7 +9,7 @@ void curl_init_global() {
 	curl_global_init(CURL_GLOBAL_ALL);
 }
 
-CURL* c_init(const char* url) {
+CURL* c_init(const char* socket, const char* url) {
 	CURL* curl = curl_easy_init();
 
 	if (!curl) {
@@ -18,6 +18,10 @@ CURL* c_init(const char* url) {
 	}
 
 	curl_easy_setopt(curl, CURLOPT_URL, url);
+	if (socket) {
+		// the host part of the URL is only used for the Host header
+		curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, socket);
+	}
 	curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1);
 	//curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
 	//curl_easy_setopt(curl, CURLOPT_USE_SSL, CURLUSESSL_ALL);
@@ -91,9 +95,9 @@ size_t write_callback(char* ptr, size_t size, size_t nmemb, struct netdata* user
 	return size * nmemb;
 }
 
-int request(const char* url, char* post_data, struct netdata* data) {
+int request(const char* socket, const char* url, char* post_data, struct netdata* data) {
 
-	CURL* curl = c_init(url);
+	CURL* curl = c_init(socket, url);
 
 	if (!curl) {
 		return 1;
@@ -8,4 +8,4 @@ struct netdata {
 };
 
 void curl_init_global();
-int request(const char* url, char* post_data, struct netdata* data);
+int request(const char* socket, const char* url, char* post_data, struct netdata* data);
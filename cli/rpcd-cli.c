@@ -68,6 +68,7 @@ int usage(int argc, char** argv, Config* config) {
 			"    -j, --json                    Machine readable (JSON) output\n"
 			"    -h, --host <host>             Target host\n"
 			"    -p, --port <port>             Target port\n"
+			"    -s, --socket <path>           Connect via a unix domain socket instead of TCP\n"
 			, config->progName);
 
 	return -1;
@@ -92,6 +93,15 @@ int set_host(int argc, char** argv, Config* config) {
 	return 1;
 }
 
+int set_socket(int argc, char** argv, Config* config) {
+	if (argc < 2) {
+		return -1;
+	}
+
+	config->socket = argv[1];
+	return 1;
+}
+
 int set_frame(int argc, char** argv, Config* config) {
 	if (argc < 2) {
 		return -1;
@@ -559,7 +569,7 @@ int fetch(Config* config, char* url_param, int (*func)(Config* config, struct ne
 		return 1;
 	}
 
-	status = request(url, NULL, &data);
+	status = request(config->socket, url, NULL, &data);
 	free(url);
 	if (!status) {
 		if (config->json) {
@@ -594,7 +604,7 @@ int exec_request(Config* config, char* format, char* name, char* post_data) {
 	}
 
 	struct netdata data = {};
-	int status = request(url, post_data, &data);
+	int status = request(config->socket, url, post_data, &data);
 	free(data.data);
 	free(url);
 
@@ -724,6 +734,7 @@ int main(int argc, char** argv) {
 
 	char* envhost = getenv("RPCD_HOST");
 	char* envport = getenv("RPCD_PORT");
+	char* envsocket = getenv("RPCD_SOCKET");
 
 	if (envhost) {
 		config.host = envhost;
@@ -733,12 +744,17 @@ int main(int argc, char** argv) {
 		config.port = strtoul(envport, NULL, 10);
 	}
 
+	if (envsocket) {
+		config.socket = envsocket;
+	}
+
 	eargs_addArgument("-?", "--help", usage, 0);
 	eargs_addArgument("-F", "--fullscreen", set_fullscreen, 0);
 	eargs_addArgument("-f", "--frame", set_frame, 1);
 	eargs_addArgument("-j", "--json", set_json, 0);
 	eargs_addArgument("-h", "--host", set_host, 1);
 	eargs_addArgument("-p", "--port", set_port, 1);
+	eargs_addArgument("-s", "--socket", set_socket, 1);
 
 	char* output[argc];
 
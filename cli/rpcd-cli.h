@@ -15,6 +15,7 @@ typedef enum {
 typedef struct {
 	char* progName;
 	char* host;
+	char* socket;
 	char* display;
 	int json;
 	int port;
@@ -1,25 +1,131 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <stdarg.h>
+#include <inttypes.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <grp.h>
 #include <netdb.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
 #include "../libs/easy_json.h"
 
+#include "rpcd.h"
 #include "x11.h"
 #include "child.h"
 #include "api.h"
 #include "control.h"
-
-static int listen_fd = -1;
+#include "websocket.h"
+
+static size_t nlisteners = 0;
+static api_listener_t* listeners = NULL;
+static mode_t socket_mode = DEFAULT_SOCKET_MODE;
+static gid_t socket_group = -1;
+static int timer_fd = -1;
+
+//HTTP I/O runs on its own thread, only requests touching display or child state reach the core loop
+static int io_epoll_fd = -1;
+static pthread_t io_thread;
+static int io_running = 0;
+static int io_stop = 0;
+static int io_failed = 0;
+static api_queue_t core_queue = {
+	.head = NULL,
+	.wake_fd = -1
+};
+static api_queue_t io_queue = {
+	.head = NULL,
+	.wake_fd = -1
+};
+//status snapshot published by the core, owned by the I/O thread
+static int snapshot_stale = 1;
+static api_message_t* status_view = NULL;
+//monotonic across reloads, the last published status is kept to find the changed parts
+static uint64_t state_generation = 0;
+static uint64_t published_generation = 0;
+static api_buffer_t published_status = {
+	0
+};
+static size_t npublished = 0;
+static api_status_slice_t* published_slices = NULL;
+
+static int timer_armed = 0;
+//requests waiting for job states, owned by the core loop
+static api_message_t* waiting = NULL;
+static int wait_timer_fd = -1;
+static time_t keepalive_timeout = DEFAULT_KEEPALIVE;
+static time_t request_timeout = DEFAULT_REQUEST_TIMEOUT;
+static size_t max_clients = DEFAULT_MAX_CLIENTS;
+//connection slots and their receive buffers are allocated once, unused slots form a free list
 static size_t nclients = 0;
 static http_client_t* clients = NULL;
+static char* recv_pool = NULL;
+static ssize_t free_clients = -1;
+
+//client deadlines, hashed by second into a wheel of doubly linked lists
+static time_t wheel_time = 0;
+static size_t ntimers = 0;
+static ssize_t timer_wheel[TIMER_WHEEL_SLOTS];
+
+//set once per daemon instance, so tokens handed out by an earlier instance are recognized
+static time_t instance_epoch = 0;
+
+//catalogs only change with the configuration, render them once per generation
+//they are immutable while the I/O thread runs
+static size_t catalog_generation = 0;
+static char catalog_etag[ETAG_LENGTH] = "";
+static api_buffer_t commands_cache = {
+	0
+};
+static api_buffer_t layouts_cache = {
+	0
+};
+
+//parsed operation of a batch request, only valid while the request is processed
+typedef struct /*_api_batch_op_t*/ {
+	ejson_object* request;
+	char* params[ROUTE_MAX_PARAMS + 1];
+	api_handler handler;
+	rpcd_child_t* command;
+	layout_t* layout;
+	char* code;
+} api_batch_op_t;
+
+//difference between the requested and the current state, only valid while the request is processed
+typedef struct /*_api_state_op_t*/ {
+	char* operation;
+	ejson_object* request;
+	rpcd_child_t* child;
+	layout_t* layout;
+	size_t display_id;
+	ssize_t frame_id;
+	char* code;
+} api_state_op_t;
+
+typedef struct /*_api_state_display_t*/ {
+	bool listed;
+	bool relayout;
+	bool failed;
+	layout_t* layout;
+} api_state_display_t;
+
+static int route_index_built = 0;
+static ssize_t route_index[ROUTE_BUCKETS];
+
+static metric_t* request_latency = NULL;
+static metric_t* unknown_requests = NULL;
 
 static int network_listener(char* host, char* port, int socktype){
 	int fd = -1, error;
@@ -58,6 +164,12 @@ static int network_listener(char* host, char* port, int socktype){
 			fprintf(stderr, "Failed to set FD_CLOEXEC on listener: %s\n", strerror(errno));
 		}
 
+		//accept only when the core loop signals readiness, but never block on it
+		error = fcntl(fd, F_GETFL, 0) | O_NONBLOCK;
+		if(fcntl(fd, F_SETFL, error) < 0){
+			fprintf(stderr, "Failed to set O_NONBLOCK on listener: %s\n", strerror(errno));
+		}
+
 		if(bind(fd, iter->ai_addr, iter->ai_addrlen)){
 			close(fd);
 			continue;
@@ -86,78 +198,304 @@ static int network_listener(char* host, char* port, int socktype){
 	return fd;
 }
 
-static int network_send(int fd, char* data){
-	ssize_t total = 0, sent;
+static int api_unix_listener(char* path){
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0), flags;
+	mode_t mask;
+	struct sockaddr_un info = {
+		.sun_family = AF_UNIX
+	};
+
+	if(fd < 0){
+		fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if(strlen(path) >= sizeof(info.sun_path)){
+		fprintf(stderr, "Socket path %s too long\n", path);
+		close(fd);
+		return -1;
+	}
+
+	flags = fcntl(fd, F_GETFD, 0) | FD_CLOEXEC;
+	if(fcntl(fd, F_SETFD, flags) < 0){
+		fprintf(stderr, "Failed to set FD_CLOEXEC on listener: %s\n", strerror(errno));
+	}
+
+	flags = fcntl(fd, F_GETFL, 0) | O_NONBLOCK;
+	if(fcntl(fd, F_SETFL, flags) < 0){
+		fprintf(stderr, "Failed to set O_NONBLOCK on listener: %s\n", strerror(errno));
+	}
+
+	//as with the control socket, we assume to be the only running instance
+	unlink(path);
+
+	//the socket is only made accessible once the configured permissions are applied
+	strncpy(info.sun_path, path, sizeof(info.sun_path) - 1);
+	mask = umask(S_IRWXG | S_IRWXO);
+	if(bind(fd, (struct sockaddr*) &info, sizeof(info))){
+		fprintf(stderr, "Failed to bind socket path %s: %s\n", path, strerror(errno));
+		umask(mask);
+		close(fd);
+		return -1;
+	}
+	umask(mask);
+
+	if(listen(fd, LISTEN_QUEUE_LENGTH)){
+		fprintf(stderr, "Failed to listen for socket %s: %s\n", path, strerror(errno));
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+	return fd;
+}
+
+static int api_add_listener(int fd, char* path){
+	listeners = realloc(listeners, (nlisteners + 1) * sizeof(api_listener_t));
+	if(!listeners){
+		fprintf(stderr, "Failed to allocate memory\n");
+		nlisteners = 0;
+		close(fd);
+		return 1;
+	}
 
-	while(total < strlen(data)){
-		sent = send(fd, data + total, strlen(data) - total, 0);
-		if(sent < 0){
-			fprintf(stderr, "Failed to send: %s\n", strerror(errno));
+	listeners[nlisteners].fd = fd;
+	listeners[nlisteners].path = NULL;
+	if(path){
+		listeners[nlisteners].path = strdup(path);
+		if(!listeners[nlisteners].path){
+			fprintf(stderr, "Failed to allocate memory\n");
+			close(fd);
+			unlink(path);
 			return 1;
 		}
-		total += sent;
 	}
+	nlisteners++;
 	return 0;
 }
 
-static void api_disconnect(http_client_t* client){
-	if(client->fd >= 0){
-		close(client->fd);
+static int api_io_manage(int fd, uint32_t events, api_io_source_t source, size_t token){
+	struct epoll_event ev = {
+		.events = events,
+		.data.u64 = ((uint64_t) token << 8) | source
+	};
+
+	if(epoll_ctl(io_epoll_fd, EPOLL_CTL_ADD, fd, &ev)){
+		fprintf(stderr, "Failed to register fd %d with the API I/O thread: %s\n", fd, strerror(errno));
+		return 1;
 	}
+	return 0;
+}
 
-	client->fd = -1;
-	client->recv_offset = 0;
-	client->payload_size = 0;
-	client->method = method_unknown;
-	client->state = http_new;
-	free(client->endpoint);
-	client->endpoint = NULL;
+static void api_queue_wake(api_queue_t* queue){
+	uint64_t wake = 1;
+
+	if(write(queue->wake_fd, &wake, sizeof(wake)) < 0 && errno != EAGAIN){
+		fprintf(stderr, "Failed to signal API queue: %s\n", strerror(errno));
+	}
 }
 
-static void api_client_init(http_client_t* client){
-	http_client_t empty_client = {
-		0
-	};
+static void api_queue_push(api_queue_t* queue, api_message_t* message){
+	//producers only prepend, a failed exchange retries with the updated head
+	message->next = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&queue->head, &message->next, message, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+	}
 
-	empty_client.fd = -1;
+	//the consumer drains everything once woken, only a push to an empty queue needs to wake it
+	if(!message->next){
+		api_queue_wake(queue);
+	}
+}
 
-	*client = empty_client;
+static api_message_t* api_queue_take(api_queue_t* queue){
+	api_message_t* message = NULL, *ordered = NULL, *next = NULL;
+	uint64_t wakes;
+
+	if(queue->wake_fd >= 0 && read(queue->wake_fd, &wakes, sizeof(wakes)) < 0 && errno != EAGAIN){
+		fprintf(stderr, "Failed to read API queue signal: %s\n", strerror(errno));
+	}
+
+	//the stack holds the newest message first, restore submission order
+	for(message = __atomic_exchange_n(&queue->head, NULL, __ATOMIC_ACQUIRE); message; message = next){
+		next = message->next;
+		message->next = ordered;
+		ordered = message;
+	}
+	return ordered;
 }
 
-static int api_accept(){
-	size_t u;
-	int fd = accept(listen_fd, NULL, NULL);
-	int flags;
+static int api_timer_arm(int arm){
+	struct itimerspec interval = {
+		.it_interval.tv_sec = arm ? 1 : 0,
+		.it_value.tv_sec = arm ? 1 : 0
+	};
 
-	if(fd < 0){
-		fprintf(stderr, "Invalid fd accepted\n");
+	if(timer_fd < 0 || timer_armed == arm){
+		return 0;
+	}
+
+	if(timerfd_settime(timer_fd, 0, &interval, NULL)){
+		fprintf(stderr, "Failed to update API timer: %s\n", strerror(errno));
 		return 1;
 	}
+	timer_armed = arm;
+	return 0;
+}
 
-	for(u = 0; u < nclients; u++){
-		if(clients[u].fd < 0){
-			break;
-		}
+static time_t api_clock(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+static void api_timer_clear(http_client_t* client){
+	size_t slot = client->deadline % TIMER_WHEEL_SLOTS;
+
+	if(!client->deadline){
+		return;
 	}
 
-	if(u == nclients){
-		clients = realloc(clients, (nclients + 1) * sizeof(http_client_t));
-		if(!clients){
-			fprintf(stderr, "Failed to allocate memory\n");
-			close(fd);
-			return 1;
-		}
-		api_client_init(clients + nclients);
-		nclients++;
+	if(client->timer_prev >= 0){
+		clients[client->timer_prev].timer_next = client->timer_next;
+	}
+	else{
+		timer_wheel[slot] = client->timer_next;
 	}
 
-	flags = fcntl(fd, F_GETFD, 0) | FD_CLOEXEC;
-	if(fcntl(fd, F_SETFD, flags) < 0){
-		fprintf(stderr, "Failed to set FD_CLOEXEC on client fd: %s\n", strerror(errno));
+	if(client->timer_next >= 0){
+		clients[client->timer_next].timer_prev = client->timer_prev;
 	}
 
-	clients[u].fd = fd;
-	return 0;
+	client->timer_prev = client->timer_next = -1;
+	client->deadline = 0;
+	ntimers--;
+}
+
+static int api_timer_set(http_client_t* client, time_t timeout){
+	ssize_t index = client - clients;
+	size_t slot;
+
+	api_timer_clear(client);
+	if(!timeout){
+		return 0;
+	}
+
+	//start the wheel at the current second when it was idle
+	if(!ntimers){
+		wheel_time = api_clock();
+	}
+
+	client->deadline = api_clock() + timeout;
+	slot = client->deadline % TIMER_WHEEL_SLOTS;
+	client->timer_next = timer_wheel[slot];
+	if(client->timer_next >= 0){
+		clients[client->timer_next].timer_prev = index;
+	}
+	timer_wheel[slot] = index;
+	ntimers++;
+	return api_timer_arm(1);
+}
+
+static void api_buffer_free(api_buffer_t* buffer){
+	free(buffer->data);
+	buffer->data = NULL;
+	buffer->alloc = buffer->length = 0;
+}
+
+static void api_message_free(api_message_t* message){
+	if(message){
+		api_buffer_free(&message->buffer);
+		free(message->slices);
+		free(message);
+	}
+}
+
+static void api_response_reset(http_client_t* client){
+	client->response_code = NULL;
+	client->response_json = false;
+	client->response_type = NULL;
+	client->response_etag = NULL;
+	client->response_headers = NULL;
+	client->response_stream = false;
+	client->response_chunked = false;
+	client->response_cached = NULL;
+	client->response.length = 0;
+}
+
+static void api_request_reset(http_client_t* client){
+	client->payload_size = 0;
+	client->method = method_unknown;
+	client->state = http_new;
+	client->keepalive = keepalive_timeout ? 1 : 0;
+	client->chunked_ok = false;
+	client->endpoint = NULL;
+	client->query = NULL;
+	client->if_none_match = NULL;
+	client->upgrade_websocket = false;
+	client->connection_upgrade = false;
+	client->websocket_key = NULL;
+	client->websocket_version = NULL;
+
+	api_response_reset(client);
+}
+
+static void api_scratch_free(http_client_t* client){
+	free(client->scratch);
+	ejson_cleanup(client->scratch_json);
+	client->scratch = NULL;
+	client->scratch_json = NULL;
+}
+
+static void api_release(http_client_t* client){
+	//return the slot to the pool, trimming buffers grown by large responses
+	if(client->send_alloc > SEND_BUFFER){
+		free(client->send_buf);
+		client->send_buf = malloc(SEND_BUFFER);
+		client->send_alloc = client->send_buf ? SEND_BUFFER : 0;
+	}
+	if(client->response.alloc > SEND_BUFFER){
+		api_buffer_free(&client->response);
+	}
+	client->next_free = free_clients;
+	free_clients = client - clients;
+
+	client->recv_offset = 0;
+	client->scan_offset = client->line_offset = client->body_offset = 0;
+	client->send_offset = 0;
+	client->send_length = 0;
+	api_scratch_free(client);
+	api_request_reset(client);
+}
+
+static void api_disconnect(http_client_t* client){
+	api_timer_clear(client);
+	if(client->fd < 0){
+		return;
+	}
+
+	//closing the fd removes it from the I/O thread event set
+	close(client->fd);
+	client->fd = -1;
+	client->events = 0;
+
+	//a request still executed by the core loop releases the slot once it completes
+	if(!client->pending){
+		api_release(client);
+	}
+}
+
+static void api_client_init(http_client_t* client, size_t index){
+	http_client_t empty_client = {
+		0
+	};
+
+	empty_client.fd = -1;
+	empty_client.next_free = -1;
+	empty_client.timer_prev = empty_client.timer_next = -1;
+	empty_client.route = -1;
+	empty_client.message.type = message_request;
+	empty_client.message.client = index;
+
+	*client = empty_client;
 }
 
 static int api_verify_enum(argument_t* arg, char* value){
@@ -172,7 +510,7 @@ static int api_verify_enum(argument_t* arg, char* value){
 	return 1;
 }
 
-static int api_parse_json(rpcd_child_t* command, command_instance_t* instance, ejson_object* ejson) {
+static int api_parse_json(rpcd_child_t* command, command_instance_t* instance, ejson_object* ejson, size_t default_display) {
 	//FIXME merge this into _start_command
 	ejson_object* args = &ejson_find_by_key(ejson, "arguments", false, false)->object;
 	size_t u;
@@ -184,7 +522,7 @@ static int api_parse_json(rpcd_child_t* command, command_instance_t* instance, e
 		err = ejson_get_string_from_key(ejson, "display", false, false, &display_name);
 		if (err == EJSON_KEY_NOT_FOUND) {
 			fprintf(stderr, "No display provided for command, using default display\n");
-			command->display_id = 0;
+			command->display_id = default_display;
 		} else if (err == EJSON_OK) {
 			command->display_id = x11_find_id(display_name);
 		} else {
@@ -245,10 +583,12 @@ static int api_parse_json(rpcd_child_t* command, command_instance_t* instance, e
 	return 0;
 }
 
-static int api_start_command(rpcd_child_t* command, char* data, size_t data_len){
+static int api_start_instance(rpcd_child_t* command, ejson_object* request, size_t default_display, int validate){
 	int rv = 1;
 	size_t u;
-	ejson_base* ejson = NULL;
+	//validation must not leave placement changes on the command
+	size_t display_id = command->display_id, restore_layout = command->restore_layout;
+	ssize_t frame_id = command->frame_id;
 	command_instance_t instance = {
 		.nargs = command->nargs,
 		.arguments = calloc(command->nargs, sizeof(char*))
@@ -259,15 +599,11 @@ static int api_start_command(rpcd_child_t* command, char* data, size_t data_len)
 		return 1;
 	}
 
-	if(data_len < 1) {
-		fprintf(stderr, "No execution information provided for command %s\n", command->name);
-		free(instance.arguments);
-		return 1;
-	}
-
-	enum ejson_errors error = ejson_parse_warnings(data, data_len, true, stderr, &ejson);
-	if (error == EJSON_OK && ejson->type == EJSON_OBJECT){
-		if(!api_parse_json(command, &instance, &ejson->object)){
+	if(!api_parse_json(command, &instance, request, default_display)){
+		if(validate){
+			rv = 0;
+		}
+		else{
 			//debug variable set
 			for(u = 0; u < command->nargs; u++){
 				fprintf(stderr, "%s.%s -> %s\n", command->name, command->args[u].name, instance.arguments[u] ? instance.arguments[u] : "-null-");
@@ -276,147 +612,501 @@ static int api_start_command(rpcd_child_t* command, char* data, size_t data_len)
 		}
 	}
 
+	if(validate){
+		command->display_id = display_id;
+		command->frame_id = frame_id;
+		command->restore_layout = restore_layout;
+	}
+
 	free(instance.arguments);
+	return rv;
+}
+
+static int api_start_command(rpcd_child_t* command, char* data, size_t data_len){
+	int rv = 1;
+	ejson_base* ejson = NULL;
+
+	if(data_len < 1) {
+		fprintf(stderr, "No execution information provided for command %s\n", command->name);
+		return 1;
+	}
+
+	enum ejson_errors error = ejson_parse_warnings(data, data_len, true, stderr, &ejson);
+	if (error == EJSON_OK && ejson->type == EJSON_OBJECT){
+		rv = api_start_instance(command, &ejson->object, 0, 0);
+	}
+
 	ejson_cleanup(ejson);
 	return rv;
 }
 
 static int api_send_header(http_client_t* client, char* code, bool json){
-	return network_send(client->fd, "HTTP/1.1 ")
-		|| network_send(client->fd, code)
-		|| network_send(client->fd, "\r\nAccess-Control-Allow-Origin: *\r\n")
-		|| (json ? network_send(client->fd, "Content-type: application/json\r\n") : 0)
-		|| network_send(client->fd, "Connection: close\r\n")
-		|| network_send(client->fd, "Server: rpcd\r\n\r\n");
+	//the header is only sent with the response body, as it contains the body length
+	client->response_code = code;
+	client->response_json = json;
+	return 0;
 }
 
-static int api_handle_header(http_client_t* client){
-	char* line = client->recv_buf;
-	
-	//reject header folding
-	if(isspace(*line)){
-		api_send_header(client, "400 Bad Request", false);
-		api_disconnect(client);
-		return 0;
-	}
-
-	//read method & endpoint
-	if(client->state == http_new){
-		if(strlen(line) < 5){
-			fprintf(stderr, "Received short HTTP initiation, rejecting\n");
-			api_send_header(client, "400 Bad Request", false);
-			api_disconnect(client);
+static int api_buffer_write(api_buffer_t* buffer, char* data, size_t length){
+	if(buffer->length + length + 1 > buffer->alloc){
+		buffer->data = realloc(buffer->data, (buffer->length + length + 1 + RECV_CHUNK) * sizeof(char));
+		if(!buffer->data){
+			fprintf(stderr, "Failed to allocate memory\n");
+			buffer->alloc = buffer->length = 0;
+			return 1;
 		}
-		else{
-			if(!strncmp(line, "GET ", 4)){
-				client->method = http_get;
-				client->endpoint = strdup(line + 4);
-			}
-			else if(!strncmp(line, "POST ", 5)){
-				client->method = http_post;
-				client->endpoint = strdup(line + 5);
-			}
-			else{
-				fprintf(stderr, "Unknown HTTP method: %s\n", line);
-				api_disconnect(client);
-				return 0;
-			}
+		buffer->alloc = buffer->length + length + 1 + RECV_CHUNK;
+	}
 
-			if(!client->endpoint){
-				fprintf(stderr, "Failed to allocate memory\n");
-				return 1;
-			}
+	memcpy(buffer->data + buffer->length, data, length);
+	buffer->length += length;
+	buffer->data[buffer->length] = 0;
+	return 0;
+}
 
-			//strip protocol info
-			if(strchr(client->endpoint, ' ')){
-				*(strchr(client->endpoint, ' ')) = 0;
-			}
+static int api_buffer_append(api_buffer_t* buffer, char* data){
+	return api_buffer_write(buffer, data, strlen(data));
+}
 
-			client->state = http_headers;
-		}
+static int api_send_reserve(http_client_t* client, size_t length){
+	//compact pending output to the front of the buffer
+	if(client->send_offset){
+		memmove(client->send_buf, client->send_buf + client->send_offset, client->send_length - client->send_offset);
+		client->send_length -= client->send_offset;
+		client->send_offset = 0;
 	}
-	else{
-		//detect end of header data
-		if(strlen(line) == 0){
-			client->state = http_data;
 
-			if(client->method == http_post && !client->payload_size){
-				fprintf(stderr, "Received POST request without Content-length header, rejecting\n");
-				api_send_header(client, "400 Bad Request", false);
-				api_disconnect(client);
-			}
+	if(client->send_length + length > client->send_alloc){
+		client->send_buf = realloc(client->send_buf, (client->send_length + length + RECV_CHUNK) * sizeof(char));
+		if(!client->send_buf){
+			fprintf(stderr, "Failed to allocate memory\n");
+			client->send_alloc = client->send_length = 0;
+			return 1;
 		}
+		client->send_alloc = client->send_length + length + RECV_CHUNK;
+	}
+	return 0;
+}
 
-		//try to find content length header
-		if(!strncasecmp(line, "Content-length:", 15)){
-			client->payload_size = strtoul(line + 16, NULL, 10);
-		}
+static int api_send_queue(http_client_t* client, char* data, size_t length){
+	if(api_send_reserve(client, length)){
+		return 1;
 	}
 
+	memcpy(client->send_buf + client->send_length, data, length);
+	client->send_length += length;
 	return 0;
 }
 
-static int api_send_commands(http_client_t* client){
-	char send_buf[RECV_CHUNK];
-	size_t commands = child_command_count(), u, p;
-	char** option = NULL;
-	rpcd_child_t* command = NULL;
+static int api_update_events(http_client_t* client){
+	size_t pending = client->send_length - client->send_offset;
+	uint32_t events = 0;
+	struct epoll_event ev;
 
-	network_send(client->fd, "[");
-	for(u = 0; u < commands; u++){
-		command = child_command_get(u);
+	//stop reading requests while a client does not accept its responses or waits for the core
+	if(client->state != http_closing && !client->pending && pending < SEND_LIMIT){
+		events |= EPOLLIN;
+	}
 
-		//dump a command
-		//FIXME escaping
-		snprintf(send_buf, sizeof(send_buf), "%s{\"name\":\"%s\",\"description\":\"%s\",\"windows\":%d,\"args\":[",
-				u ? "," : "", command->name,
-				command->description ? command->description : "",
-				(command->mode == user) ? 1 : 0);
-		network_send(client->fd, send_buf);
+	if(pending){
+		events |= EPOLLOUT;
+	}
 
-		for(p = 0; p < command->nargs; p++){
-			if(command->args[p].type == arg_enum){
-				snprintf(send_buf, sizeof(send_buf), "%s{\"name\":\"%s\", \"type\":\"enum\", \"options\":[",
-						p ? "," : "", command->args[p].name);
-				network_send(client->fd, send_buf);
-				for(option = command->args[p].additional; *option; option++){
-					snprintf(send_buf, sizeof(send_buf), "%s\"%s\"",
-							(option == command->args[p].additional) ? "" : ",",
-							*option);
-					network_send(client->fd, send_buf);
-				}
-				snprintf(send_buf, sizeof(send_buf), "]}");
-			}
-			else{
-				snprintf(send_buf, sizeof(send_buf), "%s{\"name\":\"%s\", \"type\":\"string\", \"hint\":\"%s\"}",
-						p ? "," : "", command->args[p].name,
-						command->args[p].additional ? command->args[p].additional[0] : "");
-			}
-			network_send(client->fd, send_buf);
-		}
+	if(!events && !client->pending){
+		api_disconnect(client);
+		return 0;
+	}
 
-		network_send(client->fd, "]}");
+	if(client->events == events){
+		return 0;
 	}
-	network_send(client->fd, "]");
 
+	ev.events = events;
+	ev.data.u64 = ((uint64_t) (client - clients) << 8) | io_client;
+	if(epoll_ctl(io_epoll_fd, EPOLL_CTL_MOD, client->fd, &ev)){
+		fprintf(stderr, "Failed to update API client fd %d: %s\n", client->fd, strerror(errno));
+		return 1;
+	}
+	client->events = events;
 	return 0;
 }
 
-static int api_send_layouts(http_client_t* client){
-	char send_buf[RECV_CHUNK];
-	size_t layouts = layout_count(), displays = x11_count();
-	size_t c, u, p, q, first;
-	display_t* display = NULL;
+static int api_flush(http_client_t* client, char* data, size_t length){
+	struct iovec segments[2];
+	size_t pending = client->send_length - client->send_offset;
+	ssize_t written = 0;
+	int nsegments = 0;
+
+	if(pending){
+		segments[nsegments].iov_base = client->send_buf + client->send_offset;
+		segments[nsegments].iov_len = pending;
+		nsegments++;
+	}
+
+	if(length){
+		segments[nsegments].iov_base = data;
+		segments[nsegments].iov_len = length;
+		nsegments++;
+	}
+
+	if(nsegments){
+		written = writev(client->fd, segments, nsegments);
+		if(written < 0){
+			if(errno != EAGAIN && errno != EWOULDBLOCK){
+				//failing to respond to a client should not take down the daemon
+				fprintf(stderr, "Failed to send to HTTP client: %s\n", strerror(errno));
+				api_disconnect(client);
+				return 0;
+			}
+			written = 0;
+		}
+	}
+
+	//output progress extends the deadline of connections only waiting to be drained
+	if(written > 0 && (client->state == http_closing || (client->state == http_new && !client->recv_offset))){
+		if(api_timer_set(client, (client->state == http_closing) ? request_timeout : keepalive_timeout)){
+			return 1;
+		}
+	}
+
+	//consume pending output first, then queue what is left of the new data
+	if(written >= pending){
+		client->send_offset = client->send_length = 0;
+		written -= pending;
+		if(written < length && api_send_queue(client, data + written, length - written)){
+			return 1;
+		}
+	}
+	else{
+		client->send_offset += written;
+		if(length && api_send_queue(client, data, length)){
+			return 1;
+		}
+	}
+
+	return api_update_events(client);
+}
+
+static int api_response_header(http_client_t* client, char* framing){
+	int header_length;
+
+	if(api_send_reserve(client, RECV_CHUNK)){
+		return 1;
+	}
+
+	header_length = snprintf(client->send_buf + client->send_length, RECV_CHUNK, "HTTP/1.1 %s\r\n"
+			"Access-Control-Allow-Origin: *\r\n"
+			"%s%s%s"
+			"%s"
+			"%s%s%s"
+			"%s"
+			"%s"
+			"Connection: %s\r\n"
+			"Server: rpcd\r\n\r\n",
+			client->response_code,
+			client->response_type ? "Content-type: " : "",
+			client->response_type ? client->response_type : "",
+			client->response_type ? "\r\n" : "",
+			client->response_json ? "Content-type: application/json\r\n" : "",
+			client->response_etag ? "Cache-Control: no-cache\r\nETag: " : "",
+			client->response_etag ? client->response_etag : "",
+			client->response_etag ? "\r\n" : "",
+			client->response_headers ? client->response_headers : "",
+			framing,
+			client->keepalive ? "keep-alive" : "close");
+
+	if(header_length < 0 || header_length >= RECV_CHUNK){
+		fprintf(stderr, "Failed to build response header\n");
+		return 1;
+	}
+	client->send_length += header_length;
+	metrics_observe(request_latency, metrics_time() - client->request_start);
+	return 0;
+}
+
+static int api_send_chunk(http_client_t* client){
+	char size[ETAG_LENGTH];
+
+	//the first chunk is preceded by the header, announcing chunked framing instead of a length
+	if(!client->response_chunked){
+		if(api_response_header(client, "Transfer-Encoding: chunked\r\n")){
+			return 1;
+		}
+		client->response_chunked = true;
+	}
+
+	if(!client->response.length){
+		return 0;
+	}
+
+	snprintf(size, sizeof(size), "%zx\r\n", client->response.length);
+	if(api_send_queue(client, size, strlen(size))
+			|| api_send_queue(client, client->response.data, client->response.length)
+			|| api_send_queue(client, "\r\n", 2)){
+		return 1;
+	}
+	client->response.length = 0;
+	return api_flush(client, NULL, 0);
+}
+
+static int api_send_data(http_client_t* client, char* data){
+	if(api_buffer_append(&client->response, data)){
+		return 1;
+	}
+
+	//stream large responses instead of buffering them completely
+	if(client->response_stream && client->response_code && client->response.length >= SEND_BUFFER){
+		return api_send_chunk(client);
+	}
+	return 0;
+}
+
+static int api_finish_response(http_client_t* client){
+	size_t pending = client->send_length - client->send_offset;
+	api_buffer_t* body = client->response_cached ? client->response_cached : &client->response;
+	char length_header[ETAG_LENGTH] = "";
+
+	//no further requests are read from the connection after this response
+	if(!client->keepalive || !client->response_code){
+		client->state = http_closing;
+		//bound the time for the client to take the remaining output
+		if(api_timer_set(client, request_timeout)){
+			return 1;
+		}
+	}
+
+	//no response requested, just drop the connection after all pending output
+	if(!client->response_code){
+		return api_update_events(client);
+	}
+
+	//a streamed response ends with its remaining data and an empty chunk
+	if(client->response_chunked){
+		return api_send_chunk(client)
+			|| api_send_queue(client, "0\r\n\r\n", 5)
+			|| api_flush(client, NULL, 0);
+	}
+
+	//204 and 304 responses carry no body, do not announce one
+	if(strncmp(client->response_code, "204", 3) && strncmp(client->response_code, "304", 3)){
+		snprintf(length_header, sizeof(length_header), "Content-Length: %zu\r\n", body->length);
+	}
+
+	if(api_response_header(client, length_header)){
+		return 1;
+	}
+
+	//HEAD responses announce the length of the body they omit
+	if(!length_header[0] || client->method == http_head){
+		return pending ? api_update_events(client) : api_flush(client, NULL, 0);
+	}
+
+	//while the client is blocked, just queue the response for the next writability event
+	if(pending){
+		return api_send_queue(client, body->data, body->length)
+			|| api_update_events(client);
+	}
+
+	//send header and body in one call, keeping any remainder
+	return api_flush(client, body->data, body->length);
+}
+
+static void api_reject(http_client_t* client, char* code){
+	api_send_header(client, code, false);
+	client->keepalive = 0;
+	api_finish_response(client);
+}
+
+static int api_header_token(char* value, char* token){
+	size_t length = strlen(token);
+
+	//scan a comma-separated header value for a token
+	while(*value){
+		for(; *value && (isspace(*value) || *value == ','); value++){
+		}
+
+		if(!strncasecmp(value, token, length)
+				&& (!value[length] || isspace(value[length]) || value[length] == ',')){
+			return 1;
+		}
+
+		for(; *value && *value != ','; value++){
+		}
+	}
+	return 0;
+}
+
+static int api_handle_header(http_client_t* client, char* line){
+	char* protocol = NULL;
+
+	//reject header folding
+	if(isspace(*line)){
+		api_reject(client, "400 Bad Request");
+		return 0;
+	}
+
+	//read method & endpoint
+	if(client->state == http_new){
+		if(strlen(line) < 5){
+			fprintf(stderr, "Received short HTTP initiation, rejecting\n");
+			api_reject(client, "400 Bad Request");
+		}
+		else{
+			if(!strncmp(line, "GET ", 4)){
+				client->method = http_get;
+				client->endpoint = line + 4;
+			}
+			else if(!strncmp(line, "POST ", 5)){
+				client->method = http_post;
+				client->endpoint = line + 5;
+			}
+			else if(!strncmp(line, "PUT ", 4)){
+				client->method = http_put;
+				client->endpoint = line + 4;
+			}
+			else if(!strncmp(line, "HEAD ", 5)){
+				client->method = http_head;
+				client->endpoint = line + 5;
+			}
+			else if(!strncmp(line, "OPTIONS ", 8)){
+				client->method = http_options;
+				client->endpoint = line + 8;
+			}
+			else{
+				fprintf(stderr, "Unknown HTTP method: %s\n", line);
+				client->response_headers = ALLOW_HEADER;
+				api_reject(client, "405 Method Not Allowed");
+				return 0;
+			}
+
+			//strip protocol info
+			protocol = strchr(client->endpoint, ' ');
+			if(protocol){
+				*protocol++ = 0;
+				//HTTP/1.0 clients need to explicitly request persistent connections
+				if(strcmp(protocol, "HTTP/1.1")){
+					client->keepalive = 0;
+				}
+				else{
+					client->chunked_ok = true;
+				}
+			}
+			else{
+				client->keepalive = 0;
+			}
+
+			client->state = http_headers;
+		}
+	}
+	else{
+		//detect end of header data
+		if(strlen(line) == 0){
+			client->state = http_data;
+
+			if((client->method == http_post || client->method == http_put) && !client->payload_size){
+				fprintf(stderr, "Received %s request without Content-length header, rejecting\n", (client->method == http_put) ? "PUT" : "POST");
+				api_reject(client, "400 Bad Request");
+			}
+		}
+
+		//try to find content length header
+		if(!strncasecmp(line, "Content-length:", 15)){
+			client->payload_size = strtoul(line + 16, NULL, 10);
+		}
+		else if(!strncasecmp(line, "If-None-Match:", 14)){
+			for(line += 14; isspace(*line); line++){
+			}
+			client->if_none_match = line;
+		}
+		else if(!strncasecmp(line, "Upgrade:", 8)){
+			client->upgrade_websocket = api_header_token(line + 8, "websocket");
+		}
+		else if(!strncasecmp(line, "Sec-WebSocket-Key:", 18)){
+			for(line += 18; isspace(*line); line++){
+			}
+			client->websocket_key = line;
+		}
+		else if(!strncasecmp(line, "Sec-WebSocket-Version:", 22)){
+			for(line += 22; isspace(*line); line++){
+			}
+			client->websocket_version = line;
+		}
+		else if(!strncasecmp(line, "Connection:", 11)){
+			client->connection_upgrade = api_header_token(line + 11, "upgrade");
+			if(keepalive_timeout && api_header_token(line + 11, "close")){
+				client->keepalive = 0;
+			}
+			else if(keepalive_timeout && api_header_token(line + 11, "keep-alive")){
+				client->keepalive = 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int api_render_commands(api_buffer_t* out){
+	char send_buf[RECV_CHUNK];
+	size_t commands = child_command_count(), u, p;
+	char** option = NULL;
+	rpcd_child_t* command = NULL;
+
+	api_buffer_append(out, "[");
+	for(u = 0; u < commands; u++){
+		command = child_command_get(u);
+
+		//dump a command
+		//FIXME escaping
+		snprintf(send_buf, sizeof(send_buf), "%s{\"name\":\"%s\",\"description\":\"%s\",\"windows\":%d,\"args\":[",
+				u ? "," : "", command->name,
+				command->description ? command->description : "",
+				(command->mode == user) ? 1 : 0);
+		api_buffer_append(out, send_buf);
+
+		for(p = 0; p < command->nargs; p++){
+			if(command->args[p].type == arg_enum){
+				snprintf(send_buf, sizeof(send_buf), "%s{\"name\":\"%s\", \"type\":\"enum\", \"options\":[",
+						p ? "," : "", command->args[p].name);
+				api_buffer_append(out, send_buf);
+				for(option = command->args[p].additional; *option; option++){
+					snprintf(send_buf, sizeof(send_buf), "%s\"%s\"",
+							(option == command->args[p].additional) ? "" : ",",
+							*option);
+					api_buffer_append(out, send_buf);
+				}
+				snprintf(send_buf, sizeof(send_buf), "]}");
+			}
+			else{
+				snprintf(send_buf, sizeof(send_buf), "%s{\"name\":\"%s\", \"type\":\"string\", \"hint\":\"%s\"}",
+						p ? "," : "", command->args[p].name,
+						command->args[p].additional ? command->args[p].additional[0] : "");
+			}
+			api_buffer_append(out, send_buf);
+		}
+
+		api_buffer_append(out, "]}");
+	}
+	api_buffer_append(out, "]");
+
+	return 0;
+}
+
+static int api_render_layouts(api_buffer_t* out){
+	char send_buf[RECV_CHUNK];
+	size_t layouts = layout_count(), displays = x11_count();
+	size_t c, u, p, q, first, first_screen;
+	ssize_t* screens = NULL;
+	display_t* display = NULL;
 	layout_t* layout = NULL;
 
-	network_send(client->fd, "[");
+	api_buffer_append(out, "[");
 	for(c = 0; c < displays; c++){
 		first = 1;
 		display = x11_get(c);
 
 		snprintf(send_buf, sizeof(send_buf), "%s{\"display\":\"%s\",\"layouts\":[",
 				c ? "," : "", display->name);
-		network_send(client->fd, send_buf);
+		api_buffer_append(out, send_buf);
 
 
 		for(u = 0; u < layouts; u++){
@@ -425,11 +1115,17 @@ static int api_send_layouts(http_client_t* client){
 				continue;
 			}
 	
+			screens = realloc(screens, (layout->max_screen + 1) * sizeof(ssize_t));
+			if(!screens){
+				fprintf(stderr, "Failed to allocate memory\n");
+				return 1;
+			}
+
 			//dump a single layout
 			//FIXME this is kinda ugly and disregards quoting
 			snprintf(send_buf, sizeof(send_buf), "%s{\"name\":\"%s\",\"frames\":[",
 					first ? "" : ",", layout->name);
-			network_send(client->fd, send_buf);
+			api_buffer_append(out, send_buf);
 	
 			first = 0;
 			for(p = 0; p < layout->nframes; p++){
@@ -438,33 +1134,54 @@ static int api_send_layouts(http_client_t* client){
 						layout->frames[p].bbox[0], layout->frames[p].bbox[1],
 						layout->frames[p].bbox[2], layout->frames[p].bbox[3],
 						layout->frames[p].screen[2]);
-				network_send(client->fd, send_buf);
+				api_buffer_append(out, send_buf);
 			}
 	
-			network_send(client->fd, "],\"screens\":[");
+			api_buffer_append(out, "],\"screens\":[");
 	
+			//find the first frame on each screen in one pass
 			for(q = 0; q <= layout->max_screen; q++){
-				for(p = 0; p < layout->nframes; p++){
-					if(layout->frames[p].screen[2] == q){
-						snprintf(send_buf, sizeof(send_buf), "%s{\"id\":%zu,\"width\":%zu,\"height\":%zu}",
-								q ? "," : "", layout->frames[p].screen[2],
-								layout->frames[p].screen[0], layout->frames[p].screen[1]);
-						network_send(client->fd, send_buf);
-						break;
-					}
+				screens[q] = -1;
+			}
+			for(p = 0; p < layout->nframes; p++){
+				if(screens[layout->frames[p].screen[2]] < 0){
+					screens[layout->frames[p].screen[2]] = p;
+				}
+			}
+
+			for(q = 0, first_screen = 1; q <= layout->max_screen; q++){
+				if(screens[q] >= 0){
+					p = screens[q];
+					snprintf(send_buf, sizeof(send_buf), "%s{\"id\":%zu,\"width\":%zu,\"height\":%zu}",
+							first_screen ? "" : ",", layout->frames[p].screen[2],
+							layout->frames[p].screen[0], layout->frames[p].screen[1]);
+					api_buffer_append(out, send_buf);
+					first_screen = 0;
 				}
 			}
 		
-			network_send(client->fd, "]}");
+			api_buffer_append(out, "]}");
 		}
-		network_send(client->fd, "]}");
+		api_buffer_append(out, "]}");
 	}
-	network_send(client->fd, "]");
+	api_buffer_append(out, "]");
 
 	return 0;
 }
 
-static int api_send_status(http_client_t* client){
+static int api_send_catalog(http_client_t* client, api_buffer_t* cache){
+	client->response_etag = catalog_etag;
+	if(client->if_none_match
+			&& (!strcmp(client->if_none_match, "*") || api_header_token(client->if_none_match, catalog_etag))){
+		return api_send_header(client, "304 Not Modified", false);
+	}
+
+	//serve the cached rendering without copying it into the response buffer
+	client->response_cached = cache;
+	return api_send_header(client, "200 OK", true);
+}
+
+static int api_render_status(api_buffer_t* out, api_status_slice_t* slices){
 	int rv = 0, first = 1;
 	char send_buf[RECV_CHUNK];
 	size_t u, n = 0;
@@ -472,40 +1189,54 @@ static int api_send_status(http_client_t* client){
 	display_t* display = NULL;
 	layout_t* layout = NULL;
 
-	snprintf(send_buf, sizeof(send_buf), "{\"layouts\":%zu,\"commands\":%zu,\"layout\":[",
+	//the generation is prepended by the caller
+	slices[0].offset = out->length;
+	snprintf(send_buf, sizeof(send_buf), "\"layouts\":%zu,\"commands\":%zu",
 			layout_count(), child_command_count());
-	rv |= network_send(client->fd, send_buf);
+	rv |= api_buffer_append(out, send_buf);
+	slices[0].length = out->length - slices[0].offset;
+	rv |= api_buffer_append(out, ",\"layout\":[");
 
 	n = x11_count();
 	for(u = 0; u < n; u++){
 		display = x11_get(u);
 		layout = x11_current_layout(u);
 
-		snprintf(send_buf, sizeof(send_buf), "%s{\"display\":\"%s\",\"layout\":\"%s\"}",
-				u ? "," : "", display->name, layout ? layout->name : "");
-		rv |= network_send(client->fd, send_buf);
+		rv |= api_buffer_append(out, u ? "," : "");
+		slices[u + 2].offset = out->length;
+		snprintf(send_buf, sizeof(send_buf), "{\"display\":\"%s\",\"layout\":\"%s\"}",
+				display->name, layout ? layout->name : "");
+		rv |= api_buffer_append(out, send_buf);
+		slices[u + 2].length = out->length - slices[u + 2].offset;
 	}
 
-	rv |= network_send(client->fd, "],\"running\":[");
+	rv |= api_buffer_append(out, "],");
+	slices[1].offset = out->length;
+	rv |= api_buffer_append(out, "\"running\":[");
 	n = child_command_count();
 	for(u = 0; u < n; u++){
 		cmd = child_command_get(u);
 		if(cmd->state != stopped){
 			snprintf(send_buf, sizeof(send_buf), "%s\"%s\"",
 					first ? "" : ",", cmd->name);
-			rv |= network_send(client->fd, send_buf);
+			rv |= api_buffer_append(out, send_buf);
 			first = 0;
 		}
 	}
 
-	rv |= network_send(client->fd, "]}");
+	rv |= api_buffer_append(out, "]");
+	slices[1].length = out->length - slices[1].offset;
+	rv |= api_buffer_append(out, "}");
 	return rv;
 }
 
+
 static int api_handle_reset(){
 	size_t u = 0;
 	int rv = 0;
 	for(u = 0; u < x11_count(); u++){
+		//the screen may have been rearranged outside of rpcd, always restore it
+		x11_damage(u);
 		rv |= child_discard_restores(u)
 			| child_stop_commands(u)
 			| x11_default_layout(u)
@@ -517,276 +1248,2071 @@ static int api_handle_reset(){
 	return rv;
 }
 
-static int api_handle_body(http_client_t* client){
-	int rv = 0;
-	if(!strcmp(client->endpoint, "/commands")){
-		rv = api_send_header(client, "200 OK", true)
-			|| api_send_commands(client);
+static int api_start_events(http_client_t* client){
+	char* header = "HTTP/1.1 200 OK\r\n"
+		"Access-Control-Allow-Origin: *\r\n"
+		"Content-type: text/event-stream\r\n"
+		"Cache-Control: no-cache\r\n"
+		"Connection: keep-alive\r\n"
+		"Server: rpcd\r\n\r\n"
+		"retry: 5000\n\n";
+
+	//the connection now only carries events, pushed by api_event
+	client->state = http_stream;
+	api_timer_clear(client);
+	if(client->send_length - client->send_offset){
+		return api_send_queue(client, header, strlen(header))
+			|| api_update_events(client);
+	}
+	return api_flush(client, header, strlen(header));
+}
+
+static int api_route_events(http_client_t* client, char** params, char* data, size_t length){
+	//a WebSocket connection can not be converted again
+	if(client->state == http_websocket){
+		return api_send_header(client, "400 Unknown Endpoint", false);
 	}
-	else if(!strcmp(client->endpoint, "/layouts")){
-		rv = api_send_header(client, "200 OK", true)
-			|| api_send_layouts(client);
+	return api_start_events(client);
+}
+
+static int api_route_commands(http_client_t* client, char** params, char* data, size_t length){
+	return api_send_catalog(client, &commands_cache);
+}
+
+static int api_route_layouts(http_client_t* client, char** params, char* data, size_t length){
+	return api_send_catalog(client, &layouts_cache);
+}
+
+static int api_route_reset(http_client_t* client, char** params, char* data, size_t length){
+	if(api_handle_reset()){
+		return 1;
 	}
-	else if(!strcmp(client->endpoint, "/reset")){
-		if(api_handle_reset()){
-			rv = 1;
-		}
-		else{
-			rv |= api_send_header(client, "200 OK", true)
-				|| network_send(client->fd, "{}");
+	return api_send_header(client, "200 OK", true)
+		|| api_send_data(client, "{}");
+}
+
+static char* api_query_value(char* query, char* key){
+	size_t length = strlen(key);
+
+	//values are terminated by the next parameter or the end of the query
+	for(; query && *query; query = strchr(query, '&') ? strchr(query, '&') + 1 : NULL){
+		if(!strncmp(query, key, length) && query[length] == '='){
+			return query + length + 1;
 		}
 	}
-	else if(!strcmp(client->endpoint, "/status")){
-		rv = api_send_header(client, "200 OK", true)
-			|| api_send_status(client);
+	return NULL;
+}
+
+static int api_send_status_slice(http_client_t* client, char* separator, size_t slice){
+	return api_send_data(client, separator)
+		|| api_buffer_write(&client->response, status_view->buffer.data + status_view->slices[slice].offset, status_view->slices[slice].length);
+}
+
+static int api_route_status(http_client_t* client, char** params, char* data, size_t length){
+	char* since = api_query_value(client->query, "since");
+	char send_buf[ETAG_LENGTH];
+	unsigned long epoch = 0;
+	uint64_t generation = 0;
+	size_t u;
+	int rv, first = 1, changed = 0;
+
+	//tokens are <epoch>-<generation>, the epoch identifies the daemon instance
+	if(since){
+		epoch = strtoul(since, &since, 16);
+		generation = (*since == '-') ? strtoull(since + 1, NULL, 10) : 0;
 	}
-	else if(!strncmp(client->endpoint, "/select/", 8)){
-		if(!strchr(client->endpoint + 8, '/')){
-			fprintf(stderr, "Missing display in select request\n");
-			rv = api_send_header(client, "500 Missing display", false);
-		}
-		else{
-			*strchr(client->endpoint + 8, '/') = 0;
-			x11_select_frame(x11_find_id(client->endpoint + 8), strtoul(client->endpoint + strlen(client->endpoint) + 1, NULL, 10));
-			rv = api_send_header(client, "200 OK", true)
-				|| network_send(client->fd, "{}");
-		}
+
+	//tokens from other instances or beyond the current generation are unknown, they get the full status
+	if(!since || *since != '-' || epoch != (unsigned long) instance_epoch || generation > status_view->generation){
+		//the snapshot is replaced as a whole, so the reference only has to last for this response
+		client->response_cached = &status_view->buffer;
+		return api_send_header(client, "200 OK", true);
 	}
-	else if(!strncmp(client->endpoint, "/stop/", 6)){
-		rpcd_child_t* command = child_command_find(client->endpoint + 6);
-		if(!command){
-			rv = api_send_header(client, "400 No such command", false);
-		}
-		else if(!child_active(command)){
-			rv = api_send_header(client, "500 Not running", false);
-		}
-		else if(child_stop(command)){
-			rv = api_send_header(client, "500 Failed to stop", false);
-		}
-		else{
-			rv |= api_send_header(client, "200 OK", true) ||
-				network_send(client->fd, "{}");
-		}
+
+	//events may advance the generation without changing any part of the status
+	for(u = 0; u < status_view->nslices; u++){
+		changed |= status_view->slices[u].changed > generation;
 	}
-	else if(!strncmp(client->endpoint, "/layout/", 8)){
-		if(!strchr(client->endpoint + 8, '/')){
-			fprintf(stderr, "Missing display in layout request\n");
-			rv = api_send_header(client, "500 Missing display", false);
-		}
-		else{
-			*strchr(client->endpoint + 8, '/') = 0;
-			layout_t* layout = layout_find(x11_find_id(client->endpoint + 8), client->endpoint + strlen(client->endpoint) + 1);
 
-			if(!layout){
-				rv = api_send_header(client, "400 No such layout", false);
-			}
-			else if(x11_activate_layout(layout)){
-				rv = api_send_header(client, "500 Failed to activate", false);
-			}
-			else{
-				rv = api_send_header(client, "200 OK", true)
-					|| network_send(client->fd, "{}");
-			}
-		}
+	if(!changed){
+		return api_send_header(client, "304 Not Modified", false);
 	}
-	else if(!strncmp(client->endpoint, "/command/", 9)){
-		rpcd_child_t* command = child_command_find(client->endpoint + 9);
-		if(!command){
-			rv = api_send_header(client, "400 No such command", false);
-		}
-		else if(child_active(command)){
-			rv = api_send_header(client, "500 Already running", false);
-		}
-		else if(api_start_command(command, client->recv_buf, client->payload_size)){
-			rv = api_send_header(client, "500 Failed to start", false);
-		}
-		else{
-			rv = api_send_header(client, "200 OK", true)
-				|| network_send(client->fd, "{}");
-		}
+
+	//only parts changed after the requested generation are sent
+	snprintf(send_buf, sizeof(send_buf), "{\"generation\":\"%lx-%" PRIu64 "\"", (unsigned long) instance_epoch, status_view->generation);
+	rv = api_send_header(client, "200 OK", true)
+		|| api_send_data(client, send_buf);
+
+	if(status_view->slices[0].changed > generation){
+		rv |= api_send_status_slice(client, ",", 0);
 	}
-	else if(!strncmp(client->endpoint, "/move/", 6)){
-		if(!strchr(client->endpoint + 6, '/')){
-			fprintf(stderr, "Missing target in move request\n");
-			rv = api_send_header(client, "500 Missing target", false);
+
+	for(u = 2; u < status_view->nslices; u++){
+		if(status_view->slices[u].changed > generation){
+			rv |= api_send_status_slice(client, first ? ",\"layout\":[" : ",", u);
+			first = 0;
 		}
-		else{
-			*strchr(client->endpoint + 6, '/') = 0;
-			rpcd_child_t* command = child_command_find(client->endpoint + 6);
-			if(!command || command->mode != user){
-				rv = api_send_header(client, "400 No such command", false);
+	}
+
+	if(!first){
+		rv |= api_send_data(client, "]");
+	}
+
+	if(status_view->slices[1].changed > generation){
+		rv |= api_send_status_slice(client, ",", 1);
+	}
+	return rv || api_send_data(client, "}");
+}
+
+static char* job_states[] = {
+	"none", "started", "running", "mapped", "exited"
+};
+
+static int api_job_state(char* value){
+	size_t u, length;
+
+	//query values end at the next parameter
+	for(u = 0; u < sizeof(job_states) / sizeof(char*); u++){
+		length = strlen(job_states[u]);
+		if(!strncmp(value, job_states[u], length) && (!value[length] || value[length] == '&')){
+			return u;
+		}
+	}
+	return -1;
+}
+
+static int api_send_job(http_client_t* client, child_job_t* job){
+	char send_buf[RECV_CHUNK];
+	int rv = api_send_header(client, "200 OK", true);
+
+	snprintf(send_buf, sizeof(send_buf), "{\"job\":%" PRIu64 ",\"command\":\"%s\",\"state\":\"%s\",\"pid\":%d,\"started\":%lu",
+			job->id, job->name ? job->name : "", job_states[job->state], job->pid, (unsigned long) job->start_time);
+	rv |= api_send_data(client, send_buf);
+
+	if(job->mapped >= 0){
+		snprintf(send_buf, sizeof(send_buf), ",\"mapped\":%f", job->mapped);
+		rv |= api_send_data(client, send_buf);
+	}
+
+	if(job->state == job_exited){
+		snprintf(send_buf, sizeof(send_buf), ",\"runtime\":%f,\"%s\":%d", job->runtime,
+				job->signal ? "signal" : "exit", job->signal ? job->signal : job->exit_code);
+		rv |= api_send_data(client, send_buf);
+	}
+	return rv || api_send_data(client, "}");
+}
+
+static int api_wait_job(http_client_t* client, uint64_t job, int state){
+	char* timeout = api_query_value(client->query, "timeout");
+	unsigned long milliseconds = timeout ? strtoul(timeout, NULL, 10) : DEFAULT_WAIT_TIMEOUT;
+
+	//the core loop holds the request, answering it once the job reaches the state
+	client->waiting = true;
+	client->wait_job = job;
+	client->wait_state = state;
+	client->wait_deadline = metrics_time() + ((milliseconds > MAX_WAIT_TIMEOUT) ? MAX_WAIT_TIMEOUT : milliseconds) / 1000.0;
+	return 0;
+}
+
+static int api_route_select(http_client_t* client, char** params, char* data, size_t length){
+	x11_select_frame(x11_find_id(params[0]), strtoul(params[1], NULL, 10));
+	return api_send_header(client, "200 OK", true)
+		|| api_send_data(client, "{}");
+}
+
+static int api_route_stop(http_client_t* client, char** params, char* data, size_t length){
+	rpcd_child_t* command = child_command_find(params[0]);
+	if(!command){
+		return api_send_header(client, "400 No such command", false);
+	}
+	else if(!child_active(command)){
+		return api_send_header(client, "500 Not running", false);
+	}
+	else if(child_stop(command)){
+		return api_send_header(client, "500 Failed to stop", false);
+	}
+	return api_send_header(client, "200 OK", true)
+		|| api_send_data(client, "{}");
+}
+
+static int api_route_layout(http_client_t* client, char** params, char* data, size_t length){
+	layout_t* layout = layout_find(x11_find_id(params[0]), params[1]);
+	if(!layout){
+		return api_send_header(client, "400 No such layout", false);
+	}
+	else if(x11_activate_layout(layout)){
+		return api_send_header(client, "500 Failed to activate", false);
+	}
+	return api_send_header(client, "200 OK", true)
+		|| api_send_data(client, "{}");
+}
+
+static int api_route_command(http_client_t* client, char** params, char* data, size_t length){
+	rpcd_child_t* command = child_command_find(params[0]);
+	char send_buf[ETAG_LENGTH];
+	char* wait = api_query_value(client->query, "wait");
+	int wait_state = wait ? api_job_state(wait) : job_none;
+
+	if(!command){
+		return api_send_header(client, "400 No such command", false);
+	}
+	else if(wait_state < 0){
+		return api_send_header(client, "400 No such state", false);
+	}
+	else if(child_active(command)){
+		return api_send_header(client, "500 Already running", false);
+	}
+	else if(api_start_command(command, data, length)){
+		return api_send_header(client, "500 Failed to start", false);
+	}
+
+	//the response is held by the core loop instead of polling the job
+	if(wait_state > job_started){
+		return api_wait_job(client, command->job, wait_state);
+	}
+
+	//the job tracks the instance after this response
+	snprintf(send_buf, sizeof(send_buf), "{\"job\":%" PRIu64 "}", command->job);
+	return api_send_header(client, "200 OK", true)
+		|| api_send_data(client, send_buf);
+}
+
+static int api_route_move(http_client_t* client, char** params, char* data, size_t length){
+	rpcd_child_t* command = child_command_find(params[0]);
+	if(!command || command->mode != user){
+		return api_send_header(client, "400 No such command", false);
+	}
+	else if(!child_active(command)){
+		return api_send_header(client, "500 Not running", false);
+	}
+	else if(child_raise(command, command->display_id, strtoul(params[1], NULL, 10))){
+		return api_send_header(client, "500 Raise failed", false);
+	}
+	else if(!x11_current_layout(command->display_id)){
+		return api_send_header(client, "500 No layout", false);
+	}
+	else if(x11_activate_layout(x11_current_layout(command->display_id))){
+		return api_send_header(client, "500 Relayout failed", false);
+	}
+	return api_send_header(client, "200 OK", true)
+		|| api_send_data(client, "{}");
+}
+
+static int api_route_jobs(http_client_t* client, char** params, char* data, size_t length){
+	child_job_t* job = child_job_find(strtoull(params[0], NULL, 10));
+	char* state = api_query_value(client->query, "state");
+	int wait_state = state ? api_job_state(state) : job_none;
+
+	if(!job){
+		return api_send_header(client, "404 No such job", false);
+	}
+	else if(wait_state < 0){
+		return api_send_header(client, "400 No such state", false);
+	}
+	else if(job->state < wait_state){
+		return api_wait_job(client, job->id, wait_state);
+	}
+	return api_send_job(client, job);
+}
+
+static int api_route_batch(http_client_t* client, char** params, char* data, size_t length);
+static int api_route_state(http_client_t* client, char** params, char* data, size_t length);
+static int api_route_metrics(http_client_t* client, char** params, char* data, size_t length);
+static int api_route_websocket(http_client_t* client, char** params, char* data, size_t length);
+
+static api_route_t routes[] = {
+	{"commands", 0, NULL, api_route_commands, true},
+	{"layouts", 0, NULL, api_route_layouts, true},
+	{"reset", 0, NULL, api_route_reset},
+	{"status", 0, NULL, api_route_status, true},
+	{"select", 2, "500 Missing display", api_route_select},
+	{"stop", 1, "400 No such command", api_route_stop},
+	{"layout", 2, "500 Missing display", api_route_layout},
+	{"command", 1, "400 No such command", api_route_command},
+	{"move", 2, "500 Missing target", api_route_move},
+	{"batch", 0, NULL, api_route_batch},
+	{"state", 0, NULL, api_route_state, false, http_put},
+	{"jobs", 1, "400 Missing job", api_route_jobs},
+	{"metrics", 0, NULL, api_route_metrics, true},
+	{"events", 0, NULL, api_route_events, true, http_get},
+	{"websocket", 0, NULL, api_route_websocket, true, http_get}
+};
+
+static size_t api_route_hash(char* name){
+	size_t hash = 5381;
+	for(; *name; name++){
+		hash = ((hash << 5) + hash) ^ (unsigned char) *name;
+	}
+	return hash % ROUTE_BUCKETS;
+}
+
+static void api_route_index(){
+	char labels[METRICS_LABEL_LENGTH];
+	size_t u, bucket;
+
+	//hash the first path segment of every route into an open-addressed bucket table
+	for(u = 0; u < ROUTE_BUCKETS; u++){
+		route_index[u] = -1;
+	}
+
+	request_latency = metrics_register(metric_histogram, "rpcd_api_request_duration_seconds", "Time from the start of an API request to its response", NULL);
+	unknown_requests = metrics_register(metric_counter, "rpcd_api_requests_total", "API requests per endpoint", "endpoint=\"unknown\"");
+
+	for(u = 0; u < sizeof(routes) / sizeof(api_route_t); u++){
+		snprintf(labels, sizeof(labels), "endpoint=\"%s\"", routes[u].name);
+		routes[u].requests = metrics_register(metric_counter, "rpcd_api_requests_total", "API requests per endpoint", labels);
+		for(bucket = api_route_hash(routes[u].name); route_index[bucket] >= 0; bucket = (bucket + 1) % ROUTE_BUCKETS){
+		}
+		route_index[bucket] = u;
+	}
+	route_index_built = 1;
+}
+
+static ssize_t api_route_find(char* name){
+	size_t bucket;
+
+	for(bucket = api_route_hash(name); route_index[bucket] >= 0; bucket = (bucket + 1) % ROUTE_BUCKETS){
+		if(!strcmp(routes[route_index[bucket]].name, name)){
+			return route_index[bucket];
+		}
+	}
+	return -1;
+}
+
+static int api_hex_value(char digit){
+	if(isdigit(digit)){
+		return digit - '0';
+	}
+	else if(isxdigit(digit)){
+		return tolower(digit) - 'a' + 10;
+	}
+	return -1;
+}
+
+static size_t api_route_split(char* path, char** segments, size_t max){
+	char* out = path;
+	size_t nsegments = 0;
+	int high, low;
+
+	//split the path at slashes and percent-decode the segments in place
+	for(; *path == '/'; path++){
+	}
+	segments[nsegments++] = out;
+
+	for(; *path && *path != '?' && *path != '#'; path++){
+		if(*path == '/' && nsegments < max){
+			*out++ = 0;
+			segments[nsegments++] = out;
+			continue;
+		}
+
+		if(*path == '%' && (high = api_hex_value(path[1])) >= 0 && (low = api_hex_value(path[2])) >= 0){
+			*out++ = (high << 4) | low;
+			path += 2;
+			continue;
+		}
+
+		*out++ = *path;
+	}
+	*out = 0;
+	return nsegments;
+}
+
+static int api_batch_validate(api_batch_op_t* ops, size_t nops, size_t u){
+	api_batch_op_t* op = ops + u;
+	size_t nsegments, p;
+	ssize_t route;
+	char* endpoint = NULL;
+
+	if(op->request->type != EJSON_OBJECT
+			|| ejson_get_string_from_key(op->request, "endpoint", false, false, &endpoint) != EJSON_OK){
+		op->code = "400 Missing endpoint";
+		return 1;
+	}
+
+	nsegments = api_route_split(endpoint, op->params, ROUTE_MAX_PARAMS + 1);
+	route = api_route_find(op->params[0]);
+	if(route < 0){
+		op->code = "400 Unknown Endpoint";
+		return 1;
+	}
+	op->handler = routes[route].handler;
+
+	if(op->handler != api_route_layout && op->handler != api_route_command
+			&& op->handler != api_route_stop && op->handler != api_route_move){
+		op->code = "400 Not supported in batch";
+		return 1;
+	}
+
+	if(nsegments <= routes[route].params){
+		op->code = routes[route].missing;
+		return 1;
+	}
+
+	if(op->handler == api_route_layout){
+		op->layout = layout_find(x11_find_id(op->params[1]), op->params[2]);
+		if(!op->layout){
+			op->code = "400 No such layout";
+			return 1;
+		}
+		return 0;
+	}
+
+	op->command = child_command_find(op->params[1]);
+	if(!op->command || (op->handler == api_route_move && op->command->mode != user)){
+		op->code = "400 No such command";
+		return 1;
+	}
+
+	if(op->handler == api_route_command){
+		//a command can only be started once per batch
+		for(p = 0; p < u; p++){
+			if(ops[p].handler == api_route_command && ops[p].command == op->command){
+				op->code = "500 Already running";
+				return 1;
+			}
+		}
+
+		if(child_active(op->command)){
+			op->code = "500 Already running";
+			return 1;
+		}
+		else if(api_start_instance(op->command, op->request, 0, 1)){
+			op->code = "400 Invalid arguments";
+			return 1;
+		}
+		return 0;
+	}
+
+	if(!child_active(op->command)){
+		op->code = "500 Not running";
+		return 1;
+	}
+	return 0;
+}
+
+static int api_route_metrics(http_client_t* client, char** params, char* data, size_t length){
+	char send_buf[RECV_CHUNK];
+	size_t u, c, b, nmetrics = metrics_count();
+	uint64_t cumulative;
+	metric_t* metric = NULL, *series = NULL;
+	int rv = api_send_header(client, "200 OK", false);
+
+	client->response_type = "text/plain; version=0.0.4";
+	for(u = 0; u < nmetrics && !rv; u++){
+		metric = metrics_get(u);
+
+		//series sharing a name are rendered together with the first one
+		for(c = 0; c < u; c++){
+			if(!strcmp(metrics_get(c)->name, metric->name)){
+				break;
 			}
-			else if(!child_active(command)){
-				rv = api_send_header(client, "500 Not running", false);
+		}
+		if(c < u){
+			continue;
+		}
+
+		snprintf(send_buf, sizeof(send_buf), "# HELP %s %s\n# TYPE %s %s\n", metric->name, metric->help,
+				metric->name, (metric->type == metric_counter) ? "counter" : "histogram");
+		rv |= api_send_data(client, send_buf);
+
+		for(c = u; c < nmetrics; c++){
+			series = metrics_get(c);
+			if(strcmp(series->name, metric->name)){
+				continue;
 			}
-			else if(child_raise(command, command->display_id, strtoul(client->endpoint + strlen(client->endpoint) + 1, NULL, 10))){
-				rv = api_send_header(client, "500 Raise failed", false);
+
+			if(series->type == metric_counter){
+				snprintf(send_buf, sizeof(send_buf), "%s%s%s%s %" PRIu64 "\n", series->name,
+						series->labels[0] ? "{" : "", series->labels, series->labels[0] ? "}" : "", metrics_value(series));
+				rv |= api_send_data(client, send_buf);
+				continue;
 			}
-			else if(!x11_current_layout(command->display_id)){
-				rv = api_send_header(client, "500 No layout", false);
+
+			for(b = 0, cumulative = 0; b < METRICS_BUCKETS; b++){
+				cumulative += metrics_bucket(series, b);
+				snprintf(send_buf, sizeof(send_buf), "%s_bucket{%s%sle=\"%g\"} %" PRIu64 "\n", series->name,
+						series->labels, series->labels[0] ? "," : "", metrics_bounds[b], cumulative);
+				rv |= api_send_data(client, send_buf);
 			}
-			else if(x11_activate_layout(x11_current_layout(command->display_id))){
-				rv = api_send_header(client, "500 Relayout failed", false);
+
+			snprintf(send_buf, sizeof(send_buf), "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n"
+					"%s_sum%s%s%s %f\n"
+					"%s_count%s%s%s %" PRIu64 "\n",
+					series->name, series->labels, series->labels[0] ? "," : "", metrics_value(series),
+					series->name, series->labels[0] ? "{" : "", series->labels, series->labels[0] ? "}" : "", metrics_sum(series),
+					series->name, series->labels[0] ? "{" : "", series->labels, series->labels[0] ? "}" : "", metrics_value(series));
+			rv |= api_send_data(client, send_buf);
+		}
+	}
+	return rv;
+}
+
+static int api_route_batch(http_client_t* client, char** params, char* data, size_t length){
+	int rv = 1, invalid = 0;
+	size_t nops = 0, ndisplays = x11_count(), u, c;
+	char send_buf[RECV_CHUNK];
+	ejson_base* ejson = NULL;
+	ejson_array* operations = NULL;
+	api_batch_op_t* ops = NULL;
+	layout_t** relayout = NULL;
+
+	if(length < 1 || ejson_parse_warnings(data, length, true, stderr, &ejson) != EJSON_OK
+			|| ejson->type != EJSON_OBJECT){
+		rv = api_send_header(client, "400 Invalid batch", false);
+		goto bail;
+	}
+
+	operations = &ejson_find_by_key(&ejson->object, "operations", false, false)->array;
+	if(!operations || operations->type != EJSON_ARRAY){
+		rv = api_send_header(client, "400 Invalid batch", false);
+		goto bail;
+	}
+
+	nops = operations->length;
+	ops = calloc(nops, sizeof(api_batch_op_t));
+	relayout = calloc(ndisplays, sizeof(layout_t*));
+	if((nops && !ops) || (ndisplays && !relayout)){
+		fprintf(stderr, "Failed to allocate memory\n");
+		goto bail;
+	}
+
+	//nothing is executed unless all operations are valid
+	for(u = 0; u < nops; u++){
+		ops[u].request = &operations->values[u]->object;
+		invalid |= api_batch_validate(ops, nops, u);
+	}
+
+	if(invalid){
+		for(u = 0; u < nops; u++){
+			if(!ops[u].code){
+				ops[u].code = "409 Not executed";
 			}
-			else{
-				rv = api_send_header(client, "200 OK", true)
-					|| network_send(client->fd, "{}");
+		}
+	}
+	else{
+		//stops and moves first, so the layout is applied once with the final window placement
+		for(u = 0; u < nops; u++){
+			if(ops[u].handler == api_route_stop){
+				ops[u].code = child_stop(ops[u].command) ? "500 Failed to stop" : "200 OK";
+			}
+			else if(ops[u].handler == api_route_move){
+				if(child_raise(ops[u].command, ops[u].command->display_id, strtoul(ops[u].params[2], NULL, 10))){
+					ops[u].code = "500 Raise failed";
+				}
+				else if(!relayout[ops[u].command->display_id]){
+					relayout[ops[u].command->display_id] = x11_current_layout(ops[u].command->display_id);
+				}
+			}
+			else if(ops[u].handler == api_route_layout){
+				relayout[ops[u].layout->display_id] = ops[u].layout;
+			}
+		}
+
+		for(c = 0; c < ndisplays; c++){
+			if(relayout[c] && x11_activate_layout(relayout[c])){
+				relayout[c] = NULL;
+			}
+		}
+
+		for(u = 0; u < nops; u++){
+			if(ops[u].handler == api_route_layout){
+				ops[u].code = relayout[ops[u].layout->display_id] ? "200 OK" : "500 Failed to activate";
+			}
+			else if(ops[u].handler == api_route_move && !ops[u].code){
+				ops[u].code = relayout[ops[u].command->display_id] ? "200 OK" : "500 Relayout failed";
+			}
+		}
+
+		//commands select their frames within the final layout
+		for(u = 0; u < nops; u++){
+			if(ops[u].handler == api_route_command){
+				ops[u].code = api_start_instance(ops[u].command, ops[u].request, 0, 0) ? "500 Failed to start" : "200 OK";
+			}
+		}
+	}
+
+	rv = api_send_header(client, invalid ? "400 Invalid batch" : "200 OK", true)
+		|| api_send_data(client, "{\"results\":[");
+	for(u = 0; u < nops && !rv; u++){
+		snprintf(send_buf, sizeof(send_buf), "%s{\"status\":%lu,\"message\":\"%s\"",
+				u ? "," : "", strtoul(ops[u].code, NULL, 10), strchr(ops[u].code, ' ') + 1);
+		rv |= api_send_data(client, send_buf);
+
+		//started commands report their job
+		if(ops[u].handler == api_route_command && !strcmp(ops[u].code, "200 OK")){
+			snprintf(send_buf, sizeof(send_buf), ",\"job\":%" PRIu64, ops[u].command->job);
+			rv |= api_send_data(client, send_buf);
+		}
+		rv |= api_send_data(client, "}");
+	}
+	rv = rv || api_send_data(client, "]}");
+
+bail:
+	free(ops);
+	free(relayout);
+	ejson_cleanup(ejson);
+	return rv;
+}
+
+static ssize_t api_display_find(char* name){
+	size_t u;
+
+	//unlike x11_find_id, unknown displays are not replaced by the default one
+	for(u = 0; u < x11_count(); u++){
+		if(!strcasecmp(x11_get(u)->name, name)){
+			return u;
+		}
+	}
+	return -1;
+}
+
+static api_state_op_t* api_state_add(api_state_op_t** ops, size_t* nops){
+	api_state_op_t empty = {
+		0
+	};
+
+	*ops = realloc(*ops, (*nops + 1) * sizeof(api_state_op_t));
+	if(!*ops){
+		fprintf(stderr, "Failed to allocate memory\n");
+		*nops = 0;
+		return NULL;
+	}
+
+	(*ops)[*nops] = empty;
+	(*ops)[*nops].frame_id = -1;
+	return *ops + (*nops)++;
+}
+
+static char* api_state_entry(api_state_op_t** ops, size_t* nops, ejson_object* entry, size_t display_id, int window){
+	size_t u;
+	int frame = -1;
+	char* name = NULL;
+	rpcd_child_t* child = NULL;
+	api_state_op_t* op = NULL;
+
+	if(entry->type != EJSON_OBJECT
+			|| ejson_get_string_from_key(entry, window ? "window" : "command", false, false, &name) != EJSON_OK){
+		return window ? "400 Missing window" : "400 Missing command";
+	}
+
+	child = window ? child_window_find(name) : child_command_find(name);
+	if(!child){
+		return window ? "400 No such window" : "400 No such command";
+	}
+
+	if(ejson_get_int_from_key(entry, "frame", false, false, &frame) == EJSON_WRONG_TYPE){
+		return "400 Invalid frame";
+	}
+	else if(window && frame < 0){
+		return "400 Missing frame";
+	}
+	else if(child->mode == user_no_windows){
+		frame = -1;
+	}
+
+	for(u = 0; u < *nops; u++){
+		if((*ops)[u].child == child){
+			return "400 Listed twice";
+		}
+		else if(frame >= 0 && (*ops)[u].display_id == display_id && (*ops)[u].frame_id == frame){
+			return "400 Frame assigned twice";
+		}
+	}
+
+	//a child can only be moved between displays by restarting it, which needs it to be reaped first
+	if(child->state == terminated){
+		return "409 Still terminating";
+	}
+	else if(child->state == running && child->mode != user_no_windows && child->display_id != display_id){
+		return "409 Running on another display";
+	}
+	else if(!window && child->state == stopped && api_start_instance(child, entry, display_id, 1)){
+		return "400 Invalid arguments";
+	}
+
+	op = api_state_add(ops, nops);
+	if(!op){
+		return "500 Failed to allocate memory";
+	}
+	op->request = entry;
+	op->child = child;
+	op->display_id = display_id;
+	op->frame_id = frame;
+	return NULL;
+}
+
+static int api_route_state(http_client_t* client, char** params, char* data, size_t length){
+	int rv = 1;
+	size_t ndisplays = x11_count(), ncommands = child_command_count(), nops = 0, nlisted, u, c, n;
+	ssize_t display_id;
+	char send_buf[RECV_CHUNK];
+	char* code = NULL, *name = NULL;
+	ejson_base* ejson = NULL;
+	ejson_array* targets = NULL, *children = NULL;
+	ejson_object* target = NULL;
+	rpcd_child_t* child = NULL;
+	api_state_op_t* ops = NULL, *op = NULL;
+	api_state_display_t* displays = NULL;
+
+	if(length < 1 || ejson_parse_warnings(data, length, true, stderr, &ejson) != EJSON_OK
+			|| ejson->type != EJSON_OBJECT){
+		rv = api_send_header(client, "400 Invalid state", false);
+		goto bail;
+	}
+
+	targets = &ejson_find_by_key(&ejson->object, "displays", false, false)->array;
+	if(!targets || targets->type != EJSON_ARRAY){
+		rv = api_send_header(client, "400 Invalid state", false);
+		goto bail;
+	}
+
+	displays = calloc(ndisplays, sizeof(api_state_display_t));
+	if(ndisplays && !displays){
+		fprintf(stderr, "Failed to allocate memory\n");
+		goto bail;
+	}
+
+	//nothing is changed unless the complete state is valid
+	for(u = 0; u < targets->length && !code; u++){
+		target = &targets->values[u]->object;
+		if(target->type != EJSON_OBJECT
+				|| ejson_get_string_from_key(target, "display", false, false, &name) != EJSON_OK
+				|| (display_id = api_display_find(name)) < 0){
+			code = "400 No such display";
+			break;
+		}
+		else if(displays[display_id].listed){
+			code = "400 Display listed twice";
+			break;
+		}
+
+		displays[display_id].listed = true;
+		displays[display_id].layout = x11_current_layout(display_id);
+		if(ejson_get_string_from_key(target, "layout", false, false, &name) == EJSON_OK){
+			displays[display_id].layout = layout_find(display_id, name);
+			if(!displays[display_id].layout){
+				code = "400 No such layout";
+				break;
+			}
+		}
+
+		for(c = 0; c < 2 && !code; c++){
+			children = &ejson_find_by_key(target, c ? "windows" : "commands", false, false)->array;
+			if(children && children->type != EJSON_ARRAY){
+				code = "400 Invalid state";
+				break;
+			}
+
+			for(n = 0; children && n < children->length && !code; n++){
+				code = api_state_entry(&ops, &nops, &children->values[n]->object, display_id, c);
+			}
+		}
+	}
+
+	if(code){
+		rv = api_send_header(client, code, false);
+		goto bail;
+	}
+
+	//running children on a described display that are not part of its description are stopped
+	nlisted = nops;
+	for(u = 0; u < ncommands + child_window_count(); u++){
+		child = (u < ncommands) ? child_command_get(u) : child_window_get(u - ncommands);
+		if(child->state != running || child->mode == repatriated
+				|| child->display_id >= ndisplays || !displays[child->display_id].listed){
+			continue;
+		}
+
+		for(c = 0; c < nlisted && ops[c].child != child; c++){
+		}
+
+		if(c == nlisted){
+			op = api_state_add(&ops, &nops);
+			if(!op){
+				goto bail;
+			}
+			op->operation = "stop";
+			op->child = child;
+			op->display_id = child->display_id;
+		}
+	}
+
+	//listed children are started when stopped and moved when placed in another frame
+	for(u = 0; u < nlisted; u++){
+		if(ops[u].child->state == stopped){
+			ops[u].operation = "start";
+		}
+		else if(ops[u].frame_id >= 0 && ops[u].frame_id != ops[u].child->frame_id){
+			ops[u].operation = "raise";
+			displays[ops[u].display_id].relayout = true;
+		}
+	}
+
+	for(u = 0; u < ndisplays; u++){
+		if(displays[u].listed && displays[u].layout && displays[u].layout != x11_current_layout(u)){
+			op = api_state_add(&ops, &nops);
+			if(!op){
+				goto bail;
+			}
+			op->operation = "layout";
+			op->layout = displays[u].layout;
+			op->display_id = u;
+			displays[u].relayout = true;
+		}
+	}
+
+	//stops and moves first, so each display is restored once with the final window placement
+	for(u = 0; u < nops; u++){
+		if(ops[u].operation && !strcmp(ops[u].operation, "stop")){
+			ops[u].code = child_stop(ops[u].child) ? "500 Failed to stop" : "200 OK";
+		}
+		else if(ops[u].operation && !strcmp(ops[u].operation, "raise")
+				&& child_raise(ops[u].child, ops[u].display_id, ops[u].frame_id)){
+			ops[u].code = "500 Raise failed";
+		}
+	}
+
+	for(u = 0; u < ndisplays; u++){
+		if(displays[u].relayout){
+			displays[u].failed = !displays[u].layout || x11_activate_layout(displays[u].layout);
+		}
+	}
+
+	//children select their frames within the final layout
+	for(u = 0; u < nops; u++){
+		if(!ops[u].operation || ops[u].code){
+			continue;
+		}
+		else if(!strcmp(ops[u].operation, "layout")){
+			ops[u].code = displays[ops[u].display_id].failed ? "500 Failed to activate" : "200 OK";
+		}
+		else if(!strcmp(ops[u].operation, "raise")){
+			ops[u].code = displays[ops[u].display_id].failed ? "500 Relayout failed" : "200 OK";
+		}
+		else if(ops[u].child->mode == user || ops[u].child->mode == user_no_windows){
+			ops[u].code = api_start_instance(ops[u].child, ops[u].request, ops[u].display_id, 0) ? "500 Failed to start" : "200 OK";
+		}
+		else{
+			ops[u].code = control_start_window(ops[u].child->name, ops[u].display_id, ops[u].frame_id) ? "500 Failed to start" : "200 OK";
+		}
+	}
+
+	//only the applied difference is reported
+	rv = api_send_header(client, "200 OK", true)
+		|| api_send_data(client, "{\"operations\":[");
+	for(u = 0, c = 0; u < nops && !rv; u++){
+		if(!ops[u].operation){
+			continue;
+		}
+
+		if(ops[u].layout){
+			snprintf(send_buf, sizeof(send_buf), "%s{\"operation\":\"layout\",\"display\":\"%s\",\"layout\":\"%s\",",
+					c++ ? "," : "", x11_get(ops[u].display_id)->name, ops[u].layout->name);
+		}
+		else{
+			snprintf(send_buf, sizeof(send_buf), "%s{\"operation\":\"%s\",\"%s\":\"%s\",\"display\":\"%s\",",
+					c++ ? "," : "", ops[u].operation,
+					(ops[u].child->mode == user || ops[u].child->mode == user_no_windows) ? "command" : "window",
+					ops[u].child->name, x11_get(ops[u].display_id)->name);
+		}
+		rv |= api_send_data(client, send_buf);
+
+		snprintf(send_buf, sizeof(send_buf), "\"status\":%lu,\"message\":\"%s\"",
+				strtoul(ops[u].code, NULL, 10), strchr(ops[u].code, ' ') + 1);
+		rv |= api_send_data(client, send_buf);
+
+		if(!strcmp(ops[u].operation, "start") && !strcmp(ops[u].code, "200 OK") && ops[u].child->job){
+			snprintf(send_buf, sizeof(send_buf), ",\"job\":%" PRIu64, ops[u].child->job);
+			rv |= api_send_data(client, send_buf);
+		}
+		rv |= api_send_data(client, "}");
+	}
+	rv = rv || api_send_data(client, "]}");
+
+bail:
+	free(ops);
+	free(displays);
+	ejson_cleanup(ejson);
+	return rv;
+}
+
+static int api_dispatch(http_client_t* client, ssize_t route, char* data, size_t length){
+	//waiting for the core loop does not count against the client deadlines
+	client->pending = true;
+	client->route = route;
+	client->data = data;
+	client->data_length = length;
+	api_timer_clear(client);
+	api_queue_push(&core_queue, &client->message);
+	return api_update_events(client);
+}
+
+static int api_route(http_client_t* client, char* data, size_t length){
+	char** segments = client->segments;
+	size_t nsegments;
+	ssize_t route = -1;
+
+	//splitting the path keeps the query intact
+	client->query = strchr(client->endpoint, '?');
+	if(client->query){
+		client->query++;
+	}
+
+	//the last parameter receives any remaining path
+	memset(client->segments, 0, sizeof(client->segments));
+	nsegments = api_route_split(client->endpoint, segments, ROUTE_MAX_PARAMS + 1);
+	route = api_route_find(segments[0]);
+
+	if(route < 0 || (!routes[route].params && nsegments > 1)){
+		metrics_increment(unknown_requests);
+		return api_send_header(client, "400 Unknown Endpoint", false)
+			|| api_send_data(client, "The requested endpoint is not supported");
+	}
+
+	metrics_increment(routes[route].requests);
+	if(nsegments <= routes[route].params){
+		fprintf(stderr, "Missing parameters for endpoint %s\n", routes[route].name);
+		return api_send_header(client, routes[route].missing, false);
+	}
+
+	//only read-only endpoints are safe to answer without a body, all others change state
+	//WebSocket requests are not bound to a method
+	if((client->method == http_head && (!routes[route].local || routes[route].method))
+			|| (client->state != http_websocket && client->method != http_head
+				&& (routes[route].method ? (client->method != routes[route].method) : (client->method == http_put)))){
+		client->response_headers = (routes[route].method == http_put) ? "Allow: PUT, OPTIONS\r\n"
+			: routes[route].method ? "Allow: GET, OPTIONS\r\n"
+			: routes[route].local ? "Allow: GET, POST, HEAD, OPTIONS\r\n" : "Allow: GET, POST, OPTIONS\r\n";
+		return api_send_header(client, "405 Method Not Allowed", false);
+	}
+
+	//handlers touching display or child state are executed by the core loop
+	if(!routes[route].local){
+		return api_dispatch(client, route, data, length);
+	}
+
+	//WebSocket results are framed as a whole, HEAD responses need the full length
+	client->response_stream = client->chunked_ok && client->state != http_websocket && client->method != http_head;
+	return routes[route].handler(client, segments + 1, data, length);
+}
+
+static int api_websocket_frame(http_client_t* client, websocket_opcode_t opcode, size_t length){
+	uint8_t header[WEBSOCKET_HEADER_MAX];
+
+	//the payload is queued by the caller
+	return api_send_queue(client, (char*) header, websocket_frame_header(header, opcode, length));
+}
+
+static int api_websocket_send(http_client_t* client, websocket_opcode_t opcode, char* data, size_t length){
+	return api_websocket_frame(client, opcode, length)
+		|| (length && api_send_queue(client, data, length));
+}
+
+static int api_websocket_close(http_client_t* client, uint16_t code){
+	char status[2] = {
+		code >> 8, code & 0xFF
+	};
+
+	//no further frames are read, the connection is closed once the close frame is out
+	client->state = http_closing;
+	return api_timer_set(client, request_timeout)
+		|| api_websocket_send(client, ws_close, status, sizeof(status))
+		|| api_flush(client, NULL, 0);
+}
+
+static int api_websocket_result(http_client_t* client){
+	int rv;
+	char* message = NULL, escaped[RECV_CHUNK / 4];
+	char prefix[RECV_CHUNK], *suffix = "}";
+	size_t prefix_length;
+	api_buffer_t* body = client->response_cached ? client->response_cached : &client->response;
+
+	message = strchr(client->response_code, ' ');
+	prefix_length = snprintf(prefix, sizeof(prefix), "{\"id\":%s,\"status\":%lu,\"message\":\"%s\",\"result\":%s",
+			client->message_id, strtoul(client->response_code, NULL, 10), message ? message + 1 : "",
+			client->response_json ? "" : (body->length ? "\"" : "null"));
+
+	//plain text results are embedded as string
+	if(!client->response_json && body->length){
+		api_escape(escaped, sizeof(escaped), body->data);
+		prefix_length += snprintf(prefix + prefix_length, sizeof(prefix) - prefix_length, "%s\"", escaped);
+		body = NULL;
+	}
+
+	rv = api_websocket_frame(client, ws_text, prefix_length + (body ? body->length : 0) + strlen(suffix))
+		|| api_send_queue(client, prefix, prefix_length)
+		|| (body && body->length && api_send_queue(client, body->data, body->length))
+		|| api_send_queue(client, suffix, strlen(suffix))
+		|| api_flush(client, NULL, 0);
+	metrics_observe(request_latency, metrics_time() - client->request_start);
+	api_scratch_free(client);
+	return rv;
+}
+
+static int api_websocket_message(http_client_t* client, char* data, size_t length){
+	int rv = 1, id_int = 0;
+	char* endpoint = NULL, *id_string = NULL;
+	char escaped[RECV_CHUNK / 4];
+	ejson_base* ejson = NULL;
+
+	//the parser works in place, keep the message intact for the routed endpoint
+	client->scratch = calloc(length + 1, sizeof(char));
+	if(!client->scratch){
+		fprintf(stderr, "Failed to allocate memory\n");
+		return 1;
+	}
+
+	memcpy(client->scratch, data, length);
+	rv = ejson_parse_warnings(client->scratch, length, true, stderr, &ejson);
+	client->scratch_json = ejson;
+	if(rv != EJSON_OK || ejson->type != EJSON_OBJECT
+			|| ejson_get_string_from_key(&ejson->object, "endpoint", false, false, &endpoint) != EJSON_OK){
+		fprintf(stderr, "Invalid WebSocket request, closing connection\n");
+		api_scratch_free(client);
+		return api_websocket_close(client, 1007);
+	}
+
+	//echo the request id to correlate the result
+	snprintf(client->message_id, sizeof(client->message_id), "null");
+	if(ejson_get_int_from_key(&ejson->object, "id", false, false, &id_int) == EJSON_OK){
+		snprintf(client->message_id, sizeof(client->message_id), "%d", id_int);
+	}
+	else if(ejson_get_string_from_key(&ejson->object, "id", false, false, &id_string) == EJSON_OK){
+		snprintf(client->message_id, sizeof(client->message_id), "\"%s\"", api_escape(escaped, sizeof(escaped), id_string));
+	}
+
+	//the endpoint and its parameters stay in the scratch copy until the result is sent
+	client->request_start = metrics_time();
+	client->endpoint = endpoint;
+	api_response_reset(client);
+	rv = api_route(client, data, length);
+	client->endpoint = NULL;
+	if(rv){
+		api_scratch_free(client);
+		return rv;
+	}
+	else if(client->pending){
+		return 0;
+	}
+	return api_websocket_result(client);
+}
+
+static int api_websocket_process(http_client_t* client){
+	websocket_frame_t frame;
+	ssize_t length;
+	char* payload = NULL;
+	int rv = 0;
+
+	while(client->fd >= 0 && client->state == http_websocket){
+		length = websocket_parse_frame((uint8_t*) client->recv_buf, client->recv_offset, &frame);
+		if(!length){
+			//frames need to fit the receive buffer
+			if(client->recv_offset >= RECV_BUFFER - 1){
+				fprintf(stderr, "WebSocket frame exceeds receive buffer, closing connection\n");
+				return api_websocket_close(client, 1009);
+			}
+			return 0;
+		}
+		else if(length < 0){
+			fprintf(stderr, "Invalid WebSocket frame, closing connection\n");
+			return api_websocket_close(client, 1002);
+		}
+
+		payload = client->recv_buf + frame.header_length;
+		switch(frame.opcode){
+			case ws_text:
+			case ws_binary:
+				//requests are small, fragmented messages are not supported
+				if(!frame.fin){
+					fprintf(stderr, "Fragmented WebSocket message, closing connection\n");
+					return api_websocket_close(client, 1009);
+				}
+
+				client->request_length = length;
+				client->request_next = payload[frame.payload_length];
+				payload[frame.payload_length] = 0;
+				rv = api_websocket_message(client, payload, frame.payload_length);
+				//messages executed by the core loop resume processing once they complete
+				if(client->pending){
+					return rv;
+				}
+				payload[frame.payload_length] = client->request_next;
+				break;
+			case ws_ping:
+				rv = api_websocket_send(client, ws_pong, payload, frame.payload_length)
+					|| api_flush(client, NULL, 0);
+				break;
+			case ws_pong:
+				break;
+			case ws_close:
+				return api_websocket_close(client, 1000);
+			default:
+				fprintf(stderr, "Unsupported WebSocket opcode %u, closing connection\n", frame.opcode);
+				return api_websocket_close(client, 1003);
+		}
+
+		if(rv || client->fd < 0){
+			return rv;
+		}
+
+		//remove the frame from the buffer
+		client->recv_offset -= length;
+		memmove(client->recv_buf, client->recv_buf + length, client->recv_offset);
+	}
+
+	return 0;
+}
+
+static int api_websocket_complete(http_client_t* client){
+	size_t length = client->request_length;
+
+	if(api_websocket_result(client) || client->fd < 0){
+		return client->fd < 0 ? 0 : 1;
+	}
+
+	client->recv_buf[length] = client->request_next;
+	client->recv_offset -= length;
+	memmove(client->recv_buf, client->recv_buf + length, client->recv_offset);
+	return api_websocket_process(client);
+}
+
+static int api_start_websocket(http_client_t* client){
+	char accept[WEBSOCKET_ACCEPT_LENGTH];
+	char header[RECV_CHUNK];
+	int length;
+
+	if(client->method != http_get || !client->upgrade_websocket || !client->connection_upgrade
+			|| !client->websocket_key || websocket_accept_key(client->websocket_key, accept)){
+		fprintf(stderr, "Invalid WebSocket upgrade request\n");
+		client->keepalive = 0;
+		return api_send_header(client, "400 Bad Request", false);
+	}
+
+	//other protocol versions are answered with the supported one
+	if(!client->websocket_version || strcmp(client->websocket_version, WEBSOCKET_VERSION)){
+		fprintf(stderr, "Unsupported WebSocket version %s\n", client->websocket_version ? client->websocket_version : "-none-");
+		client->response_headers = "Sec-WebSocket-Version: " WEBSOCKET_VERSION "\r\n";
+		client->keepalive = 0;
+		return api_send_header(client, "426 Upgrade Required", false);
+	}
+
+	length = snprintf(header, sizeof(header), "HTTP/1.1 101 Switching Protocols\r\n"
+			"Upgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Accept: %s\r\n"
+			"Server: rpcd\r\n\r\n", accept);
+
+	//all further data on the connection is framed, websockets may idle indefinitely
+	client->state = http_websocket;
+	api_timer_clear(client);
+	return api_send_queue(client, header, length)
+		|| api_flush(client, NULL, 0);
+}
+
+static int api_route_websocket(http_client_t* client, char** params, char* data, size_t length){
+	//a WebSocket connection can not be upgraded again
+	if(client->state == http_websocket){
+		return api_send_header(client, "400 Unknown Endpoint", false);
+	}
+	return api_start_websocket(client);
+}
+
+static int api_handle_body(http_client_t* client){
+	//preflight requests are answered for all endpoints without routing them
+	if(client->method == http_options){
+		client->response_headers = CORS_PREFLIGHT_HEADERS;
+		return api_send_header(client, "204 No Content", false)
+			|| api_finish_response(client);
+	}
+
+	if(client->method == http_head){
+		return api_route(client, NULL, 0)
+			|| api_finish_response(client);
+	}
+
+	//event streams and WebSocket upgrades take over the connection instead of responding
+	return api_route(client, client->recv_buf + client->body_offset, client->payload_size)
+		|| (!client->pending && client->state != http_stream && client->state != http_websocket
+			&& api_finish_response(client));
+}
+
+static void api_consume(http_client_t* client, size_t length){
+	//drop a finished request, moving any pipelined data to the front once
+	client->recv_offset -= length;
+	memmove(client->recv_buf, client->recv_buf + length, client->recv_offset);
+	client->scan_offset = client->line_offset = client->body_offset = 0;
+}
+
+static int api_request_done(http_client_t* client){
+	client->recv_buf[client->request_length] = client->request_next;
+
+	//connection will be closed once the response is sent or was converted to an event stream
+	if(client->fd < 0 || client->state == http_closing || client->state == http_stream){
+		return 0;
+	}
+
+	//remove the request from the buffer and prepare for the next one
+	api_consume(client, client->request_length);
+
+	//frames may directly follow the upgrade request
+	if(client->state == http_websocket){
+		return 0;
+	}
+	api_request_reset(client);
+
+	//wait for the next request, or limit the time to complete a pipelined one
+	if(api_timer_set(client, client->recv_offset ? request_timeout : keepalive_timeout)){
+		return 1;
+	}
+	client->request_start = metrics_time();
+	return 0;
+}
+
+static int api_process(http_client_t* client){
+	char* line_end = NULL;
+
+	while(client->fd >= 0 && !client->pending
+			&& client->state != http_closing && client->state != http_stream && client->state != http_websocket){
+		if(client->state != http_data){
+			//only scan data not yet seen for the end of the current line
+			line_end = memchr(client->recv_buf + client->scan_offset, '\n', client->recv_offset - client->scan_offset);
+			if(!line_end){
+				client->scan_offset = client->recv_offset;
+				if(client->recv_offset >= RECV_BUFFER - 1){
+					fprintf(stderr, "HTTP request header exceeds receive buffer, rejecting\n");
+					api_reject(client, "431 Request Header Fields Too Large");
+				}
+				return 0;
+			}
+
+			//terminate complete line in place, accepting bare LF line endings
+			client->scan_offset = line_end - client->recv_buf + 1;
+			if(line_end > client->recv_buf + client->line_offset && line_end[-1] == '\r'){
+				line_end--;
+			}
+			*line_end = 0;
+
+			//handle header lines
+			if(api_handle_header(client, client->recv_buf + client->line_offset)){
+				return 1;
+			}
+			client->line_offset = client->body_offset = client->scan_offset;
+
+			//the client may have been rejected by the header handler
+			if(client->fd < 0 || client->state == http_closing){
+				return 0;
+			}
+
+			//the body gets its own deadline
+			if(client->state == http_data && client->payload_size && api_timer_set(client, request_timeout)){
+				return 1;
+			}
+			continue;
+		}
+
+		//bodies must fit the receive buffer along with the header
+		if(client->payload_size >= RECV_BUFFER - client->body_offset){
+			fprintf(stderr, "HTTP request body of %zu bytes exceeds receive buffer, rejecting\n", client->payload_size);
+			api_reject(client, "413 Payload Too Large");
+			return 0;
+		}
+
+		//handle http body
+		if(client->recv_offset - client->body_offset < client->payload_size){
+			fprintf(stderr, "Missing %zu bytes of payload data, waiting for input\n",
+					client->payload_size - (client->recv_offset - client->body_offset));
+			return 0;
+		}
+
+		//terminate data, preserving the start of any pipelined request
+		client->request_length = client->body_offset + client->payload_size;
+		client->request_next = client->recv_buf[client->request_length];
+		client->recv_buf[client->request_length] = 0;
+		//handle the request
+		if(api_handle_body(client)){
+			return 1;
+		}
+
+		//requests executed by the core loop resume processing once they complete
+		if(client->pending){
+			return 0;
+		}
+
+		if(api_request_done(client)){
+			return 1;
+		}
+	}
+
+	if(client->fd >= 0 && !client->pending && client->state == http_websocket){
+		return api_websocket_process(client);
+	}
+	return 0;
+}
+
+static int api_data(http_client_t* client){
+	ssize_t bytes_recv;
+
+	//event stream clients do not send further requests, discard anything they send
+	bytes_recv = recv(client->fd, client->recv_buf + ((client->state == http_stream) ? 0 : client->recv_offset),
+			RECV_BUFFER - 1 - ((client->state == http_stream) ? 0 : client->recv_offset), 0);
+	if(bytes_recv < 0){
+		if(errno == EAGAIN || errno == EWOULDBLOCK){
+			return 0;
+		}
+		fprintf(stderr, "Failed to receive from HTTP client: %s\n", strerror(errno));
+		api_disconnect(client);
+		return 0;
+	}
+	else if(bytes_recv == 0){
+		api_disconnect(client);
+		return 0;
+	}
+
+	if(client->state == http_stream){
+		return 0;
+	}
+
+	//the first data of a new request starts its header deadline
+	if(client->state == http_new && !client->recv_offset){
+		client->request_start = metrics_time();
+		if(api_timer_set(client, request_timeout)){
+			return 1;
+		}
+	}
+
+	client->recv_offset += bytes_recv;
+	return api_process(client);
+}
+
+static void api_timeout(http_client_t* client){
+	//idle persistent connections are closed silently
+	if(client->state != http_new || client->recv_offset){
+		fprintf(stderr, "API client timed out, disconnecting\n");
+	}
+	api_disconnect(client);
+}
+
+static int api_timer(int fd, uint32_t events, size_t token){
+	uint64_t expirations;
+	time_t now = api_clock();
+	ssize_t u, next;
+
+	if(read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN){
+		fprintf(stderr, "Failed to read API timer: %s\n", strerror(errno));
+	}
+
+	//after long stalls, visiting every slot once is enough
+	if(now - wheel_time > TIMER_WHEEL_SLOTS){
+		wheel_time = now - TIMER_WHEEL_SLOTS;
+	}
+
+	//visit each slot passed since the last tick, deadlines beyond the wheel stay in their slot
+	for(; wheel_time < now && ntimers; wheel_time++){
+		for(u = timer_wheel[(wheel_time + 1) % TIMER_WHEEL_SLOTS]; u >= 0; u = next){
+			next = clients[u].timer_next;
+			if(clients[u].deadline <= now){
+				api_timeout(clients + u);
 			}
 		}
 	}
-	else{
-		rv = api_send_header(client, "400 Unknown Endpoint", false)
-			|| network_send(client->fd, "The requested endpoint is not supported");
+	wheel_time = now;
+
+	if(!ntimers){
+		return api_timer_arm(0);
 	}
+	return 0;
+}
 
-	api_disconnect(client);
-	return rv;
+char* api_escape(char* out, size_t length, char* in){
+	size_t u = 0;
+
+	//escape a string for inclusion in JSON output, dropping control characters
+	for(; in && *in && u + 2 < length; in++){
+		if(*in == '"' || *in == '\\'){
+			out[u++] = '\\';
+		}
+		else if(iscntrl(*in)){
+			continue;
+		}
+		out[u++] = *in;
+	}
+	out[u] = 0;
+	return out;
 }
 
-static int api_data(http_client_t* client){
-	ssize_t u, bytes_recv, bytes_left = client->data_allocated - client->recv_offset;
+static void api_broadcast(api_buffer_t* event){
+	size_t u, pending;
 
-	//limit receive/processing window
-	if(client->recv_offset >= HARD_SIZE_LIMIT){
-		api_disconnect(client);
+	for(u = 0; u < nclients; u++){
+		if(clients[u].fd < 0 || clients[u].state != http_stream){
+			continue;
+		}
+
+		pending = clients[u].send_length - clients[u].send_offset;
+		if(pending >= SEND_LIMIT){
+			fprintf(stderr, "Event stream client not reading, disconnecting\n");
+			api_disconnect(clients + u);
+		}
+		//writability is already being waited for
+		else if(pending){
+			api_send_queue(clients + u, event->data, event->length);
+		}
+		else if(api_flush(clients + u, event->data, event->length)){
+			api_disconnect(clients + u);
+		}
+	}
+}
+
+void api_event(char* type, char* format, ...){
+	char event[RECV_CHUNK];
+	int length, data_length;
+	api_message_t* message = NULL;
+	va_list args;
+
+	//every event marks a change of the daemon state, possibly visible in the status snapshot
+	snapshot_stale = 1;
+	state_generation++;
+
+	length = snprintf(event, sizeof(event), "event: %s\ndata: ", type);
+	va_start(args, format);
+	data_length = vsnprintf(event + length, sizeof(event) - length, format, args);
+	va_end(args);
+
+	if(data_length < 0 || length + data_length + 3 > sizeof(event)){
+		fprintf(stderr, "Event %s too long, not sent\n", type);
+		return;
+	}
+	length += data_length;
+	event[length++] = '\n';
+	event[length++] = '\n';
+	event[length] = 0;
+
+	//without an I/O thread, there are no event stream clients
+	if(!io_running){
+		return;
+	}
+
+	message = calloc(1, sizeof(api_message_t));
+	if(!message || api_buffer_append(&message->buffer, event)){
+		fprintf(stderr, "Failed to allocate memory\n");
+		api_message_free(message);
+		return;
+	}
+	message->type = message_event;
+	api_queue_push(&io_queue, message);
+}
+
+static int api_publish(){
+	api_message_t* message = NULL;
+	api_buffer_t status = {
+		0
+	};
+	api_status_slice_t* slices = NULL;
+	char prefix[ETAG_LENGTH];
+	size_t nslices = x11_count() + 2, u;
+	int changed = 0;
+
+	if(!snapshot_stale){
 		return 0;
 	}
 
-	if(bytes_left < RECV_CHUNK){
-		client->recv_buf = realloc(client->recv_buf, (client->data_allocated + RECV_CHUNK) * sizeof(char));
-		if(!client->recv_buf){
-			fprintf(stderr, "Failed to allocate memory\n");
+	//catalogs are rendered once per configuration generation, before the I/O thread is started
+	if(!catalog_etag[0]){
+		if(!instance_epoch){
+			instance_epoch = time(NULL);
+		}
+		snprintf(catalog_etag, sizeof(catalog_etag), "\"%lx-%zu\"", (unsigned long) instance_epoch, catalog_generation);
+
+		if(api_render_commands(&commands_cache) || api_render_layouts(&layouts_cache)){
 			return 1;
 		}
+	}
 
-		client->data_allocated += RECV_CHUNK;
-		bytes_left += RECV_CHUNK;
+	message = calloc(1, sizeof(api_message_t));
+	slices = calloc(nslices, sizeof(api_status_slice_t));
+	if(!message || !slices){
+		fprintf(stderr, "Failed to allocate memory\n");
+		goto bail;
 	}
 
-	bytes_recv = recv(client->fd, client->recv_buf + client->recv_offset, bytes_left - 1, 0);
-	if(bytes_recv < 0){
-		fprintf(stderr, "Failed to receive from HTTP client: %s\n", strerror(errno));
-		api_disconnect(client);
-		return 0;
+	message->type = message_status;
+	message->nslices = nslices;
+	message->slices = calloc(nslices, sizeof(api_status_slice_t));
+	if(!message->slices || api_render_status(&status, slices)){
+		goto bail;
 	}
-	else if(bytes_recv == 0){
-		api_disconnect(client);
-		return 0;
+
+	//parts identical to the last published status keep the generation they last changed in
+	for(u = 0; u < nslices; u++){
+		if(nslices == npublished && slices[u].length == published_slices[u].length
+				&& !memcmp(status.data + slices[u].offset, published_status.data + published_slices[u].offset, slices[u].length)){
+			slices[u].changed = published_slices[u].changed;
+			continue;
+		}
+
+		//changes not announced by an event still need a new generation
+		if(!changed && state_generation == published_generation){
+			state_generation++;
+		}
+		changed = 1;
+		slices[u].changed = state_generation;
 	}
 
-	//handle complete lines (except body data)
-	for(u = 0; client->state != http_data && u < bytes_recv - 1; u++){
-		if(!strncmp(client->recv_buf + client->recv_offset + u, "\r\n", 2)){
-			//terminate complete line
-			client->recv_buf[client->recv_offset + u] = 0;
+	snprintf(prefix, sizeof(prefix), "{\"generation\":\"%lx-%" PRIu64 "\",", (unsigned long) instance_epoch, state_generation);
+	if(api_buffer_append(&message->buffer, prefix) || api_buffer_write(&message->buffer, status.data, status.length)){
+		goto bail;
+	}
 
-			//handle header lines
-			if(api_handle_header(client)){
-				return 1;
+	message->generation = state_generation;
+	for(u = 0; u < nslices; u++){
+		message->slices[u] = slices[u];
+		message->slices[u].offset += strlen(prefix);
+	}
+
+	api_buffer_free(&published_status);
+	free(published_slices);
+	published_status = status;
+	published_slices = slices;
+	npublished = nslices;
+	published_generation = state_generation;
+
+	snapshot_stale = 0;
+	api_queue_push(&io_queue, message);
+	return 0;
+
+bail:
+	api_buffer_free(&status);
+	free(slices);
+	api_message_free(message);
+	return 1;
+}
+
+static int api_wait_check(){
+	api_message_t* message = NULL, *next = NULL, *held = NULL;
+	http_client_t* client = NULL;
+	child_job_t* job = NULL;
+	double now = metrics_time(), deadline = 0;
+	struct itimerspec expiry = {
+		0
+	};
+	int rv = 0;
+
+	for(message = waiting; message; message = next){
+		next = message->next;
+		client = clients + message->client;
+		job = child_job_find(client->wait_job);
+
+		//jobs replaced in the table will not change anymore
+		if(job && job->state < client->wait_state && now < client->wait_deadline){
+			if(!deadline || client->wait_deadline < deadline){
+				deadline = client->wait_deadline;
 			}
+			message->next = held;
+			held = message;
+			continue;
+		}
+
+		client->waiting = false;
+		rv |= job ? api_send_job(client, job) : api_send_header(client, "404 No such job", false);
+		api_queue_push(&io_queue, message);
+	}
+	waiting = held;
+
+	//wake up for the earliest deadline, an expiry of 0 disarms the timer
+	expiry.it_value.tv_sec = deadline;
+	expiry.it_value.tv_nsec = (deadline - (time_t) deadline) * 1e9;
+	if(timerfd_settime(wait_timer_fd, TFD_TIMER_ABSTIME, &expiry, NULL)){
+		fprintf(stderr, "Failed to arm API wait timer: %s\n", strerror(errno));
+		return 1;
+	}
+	return rv;
+}
+
+static int api_wait_timer(int fd, uint32_t events, size_t token){
+	uint64_t expirations;
+
+	if(read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN){
+		fprintf(stderr, "Failed to read API wait timer: %s\n", strerror(errno));
+	}
+	return api_publish() || api_wait_check();
+}
+
+static int api_core_event(int fd, uint32_t events, size_t token){
+	api_message_t* message = NULL, *next = NULL, *done = NULL;
+	http_client_t* client = NULL;
+	int rv = 0;
 
-			//FIXME might want to check for inline disconnect here
+	if(__atomic_load_n(&io_failed, __ATOMIC_ACQUIRE)){
+		fprintf(stderr, "API I/O thread failed\n");
+		return 1;
+	}
+
+	//the I/O thread does not touch a client while its request is pending
+	done = api_queue_take(&core_queue);
+	for(message = done; message; message = message->next){
+		client = clients + message->client;
+		rv |= routes[client->route].handler(client, client->segments + 1, client->data, client->data_length);
+	}
+
+	//publish any status change ahead of the responses, so clients read their own writes
+	snapshot_stale = 1;
+	rv |= api_publish();
+
+	for(message = done; message; message = next){
+		next = message->next;
+		if(clients[message->client].waiting){
+			message->next = waiting;
+			waiting = message;
+			continue;
+		}
+		api_queue_push(&io_queue, message);
+	}
+	return rv || (waiting && api_wait_check());
+}
+
+static int api_complete(http_client_t* client){
+	client->pending = false;
+
+	//the client went away while the core loop executed its request
+	if(client->fd < 0){
+		api_release(client);
+		return 0;
+	}
+
+	if(client->state == http_websocket){
+		return api_websocket_complete(client);
+	}
 
-			//remove line from buffer
-			bytes_recv -= (u + 2);
-			memmove(client->recv_buf, client->recv_buf + client->recv_offset + u + 2, bytes_recv);
-			client->recv_offset = 0;
-			//start at the beginning of the buffer (incremented by loop)
-			u = -1;
+	return api_finish_response(client)
+		|| api_request_done(client)
+		|| api_process(client);
+}
+
+static int api_io_messages(){
+	api_message_t* message = NULL, *next = NULL;
+	int rv = 0;
+
+	for(message = api_queue_take(&io_queue); message; message = next){
+		next = message->next;
+		switch(message->type){
+			case message_request:
+				rv |= api_complete(clients + message->client);
+				break;
+			case message_event:
+				api_broadcast(&message->buffer);
+				api_message_free(message);
+				break;
+			case message_status:
+				//responses only reference the snapshot while they are built
+				api_message_free(status_view);
+				status_view = message;
+				break;
 		}
 	}
+	return rv;
+}
+
+static int api_client_event(int fd, uint32_t events, size_t token){
+	if(token >= nclients || clients[token].fd != fd){
+		fprintf(stderr, "Stale API client event on fd %d\n", fd);
+		return 0;
+	}
 
-	//handle http body
-	if(client->state == http_data){
-		if((client->payload_size && client->recv_offset + bytes_recv == client->payload_size) || !client->payload_size){
-			//terminate data
-			client->recv_buf[client->payload_size] = 0;
-			//handle the request
-			return api_handle_body(client);
+	if(events & EPOLLOUT){
+		if(api_flush(clients + token, NULL, 0)){
+			return 1;
 		}
-		else{
-			fprintf(stderr, "Missing %zu bytes of payload data, waiting for input\n", client->payload_size - (client->recv_offset + bytes_recv));
+
+		if(clients[token].fd < 0){
+			return 0;
 		}
 	}
 
-	client->recv_offset += bytes_recv;
+	//peers hanging up during a pending request release their slot once it completes
+	if(clients[token].pending){
+		if(events & (EPOLLHUP | EPOLLERR)){
+			api_disconnect(clients + token);
+		}
+		return 0;
+	}
+
+	if(events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+		return api_data(clients + token);
+	}
 	return 0;
 }
 
-int api_loop(fd_set* in, fd_set* out, int* max_fd){
+static int api_accept(int listener, uint32_t events, size_t token){
+	char* shed_response = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
 	size_t u;
+	//set atomically, children may be forked on the core thread at any time.
+	//responses are buffered and flushed on writability, never block on a slow client
+	int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
 
-	//re-select on the listen fd
-	FD_SET(listen_fd, out);
-	*max_fd = (listen_fd > *max_fd) ? listen_fd : *max_fd;
-
-	if(FD_ISSET(listen_fd, in)){
-		//handle new clients
-		if(api_accept()){
-			return 1;
+	if(fd < 0){
+		if(errno != EAGAIN && errno != EWOULDBLOCK){
+			fprintf(stderr, "Failed to accept API client: %s\n", strerror(errno));
 		}
+		return 0;
 	}
 
-	for(u = 0; u < nclients; u++){
-		if(clients[u].fd >= 0 && FD_ISSET(clients[u].fd, in)){
-			//handle client data
-			if(api_data(clients + u)){
-				return 1;
+	//shed excess clients right away instead of queueing them
+	if(free_clients < 0){
+		fprintf(stderr, "Maximum of %zu API clients reached, rejecting connection\n", max_clients);
+		send(fd, shed_response, strlen(shed_response), MSG_DONTWAIT | MSG_NOSIGNAL);
+		close(fd);
+		return 0;
+	}
+
+	u = free_clients;
+
+	if(api_io_manage(fd, EPOLLIN, io_client, u)){
+		close(fd);
+		return 0;
+	}
+
+	free_clients = clients[u].next_free;
+	clients[u].next_free = -1;
+	clients[u].fd = fd;
+	clients[u].events = EPOLLIN;
+	api_request_reset(clients + u);
+	//the first request has to arrive in time as well
+	return api_timer_set(clients + u, request_timeout);
+}
+
+static void* api_io_thread(void* arg){
+	struct epoll_event events[CORE_MAX_EVENTS];
+	size_t token;
+	int ready, u, rv;
+
+	//the first status snapshot is published before the thread is started
+	rv = api_io_messages();
+	while(!rv && !__atomic_load_n(&io_stop, __ATOMIC_ACQUIRE)){
+		ready = epoll_wait(io_epoll_fd, events, CORE_MAX_EVENTS, -1);
+		if(ready < 0){
+			if(errno == EINTR){
+				continue;
 			}
+			fprintf(stderr, "API epoll_wait() failed: %s\n", strerror(errno));
+			rv = 1;
+			break;
 		}
 
-		//not collapsing conditions allows us to respond to disconnects in the previous handler
-		if(clients[u].fd >= 0){
-			//re-select on the client
-			FD_SET(clients[u].fd, out);
-			*max_fd = (clients[u].fd > *max_fd) ? clients[u].fd : *max_fd;
+		for(u = 0; u < ready && !rv; u++){
+			token = events[u].data.u64 >> 8;
+			switch(events[u].data.u64 & 0xFF){
+				case io_client:
+					//handlers earlier in this batch may have disconnected the client
+					if(token < nclients && clients[token].fd >= 0){
+						rv = api_client_event(clients[token].fd, events[u].events, token);
+					}
+					break;
+				case io_listener:
+					rv = (token < nlisteners) ? api_accept(listeners[token].fd, events[u].events, token) : 0;
+					break;
+				case io_timer:
+					rv = api_timer(timer_fd, events[u].events, token);
+					break;
+				case io_messages:
+					rv = api_io_messages();
+					break;
+			}
 		}
 	}
 
-	return 0;
+	//have the core loop shut down the daemon
+	if(rv){
+		__atomic_store_n(&io_failed, 1, __ATOMIC_RELEASE);
+		api_queue_wake(&core_queue);
+	}
+	return NULL;
 }
 
 int api_config(char* option, char* value){
 	char* separator = value;
+	struct group* group = NULL;
+	size_t u;
+	int fd;
 	if(!strcmp(option, "bind")){
-		separator = strchr(value, ' ');
-		if(separator){
-			*separator = 0;
-			separator++;
+		if(!strncmp(value, UNIX_BIND_PREFIX, strlen(UNIX_BIND_PREFIX))){
+			value += strlen(UNIX_BIND_PREFIX);
+			fd = api_unix_listener(value);
 		}
 		else{
-			separator = DEFAULT_PORT;
+			separator = strchr(value, ' ');
+			if(separator){
+				*separator = 0;
+				separator++;
+			}
+			else{
+				separator = DEFAULT_PORT;
+			}
+
+			fd = network_listener(value, separator, SOCK_STREAM);
+			value = NULL;
+		}
+
+		if(fd < 0 || api_add_listener(fd, value)){
+			return 1;
 		}
 
-		listen_fd = network_listener(value, separator, SOCK_STREAM);
-		return listen_fd < 0;
+		if(timer_fd < 0){
+			for(u = 0; u < TIMER_WHEEL_SLOTS; u++){
+				timer_wheel[u] = -1;
+			}
+
+			timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+			if(timer_fd < 0){
+				fprintf(stderr, "Failed to create API timer: %s\n", strerror(errno));
+				return 1;
+			}
+		}
+		return 0;
+	}
+	else if(!strcmp(option, "keepalive")){
+		keepalive_timeout = strtoul(value, NULL, 10);
+		return 0;
+	}
+	else if(!strcmp(option, "timeout")){
+		request_timeout = strtoul(value, NULL, 10);
+		if(!request_timeout){
+			fprintf(stderr, "API request timeout must be at least one second\n");
+			return 1;
+		}
+		return 0;
+	}
+	else if(!strcmp(option, "socket-mode")){
+		socket_mode = strtoul(value, &separator, 8);
+		if(*separator || socket_mode > 0777){
+			fprintf(stderr, "Invalid socket mode %s, expected octal permissions\n", value);
+			return 1;
+		}
+		return 0;
+	}
+	else if(!strcmp(option, "socket-group")){
+		group = getgrnam(value);
+		if(!group){
+			fprintf(stderr, "Unknown group %s for API sockets\n", value);
+			return 1;
+		}
+		socket_group = group->gr_gid;
+		return 0;
+	}
+	else if(!strcmp(option, "max-clients")){
+		max_clients = strtoul(value, NULL, 10);
+		if(!max_clients){
+			fprintf(stderr, "API client limit must be at least one\n");
+			return 1;
+		}
+		return 0;
 	}
 
 	fprintf(stderr, "Unknown option %s for web section\n", option);
 	return 1;
 }
 
+static int api_pool_init(){
+	size_t u;
+
+	clients = calloc(max_clients, sizeof(http_client_t));
+	recv_pool = calloc(max_clients, RECV_BUFFER);
+	if(!clients || !recv_pool){
+		fprintf(stderr, "Failed to allocate memory\n");
+		return 1;
+	}
+	nclients = max_clients;
+
+	for(u = 0; u < nclients; u++){
+		api_client_init(clients + u, u);
+		clients[u].recv_buf = recv_pool + u * RECV_BUFFER;
+		clients[u].send_buf = malloc(SEND_BUFFER);
+		if(!clients[u].send_buf){
+			fprintf(stderr, "Failed to allocate memory\n");
+			return 1;
+		}
+		clients[u].send_alloc = SEND_BUFFER;
+		clients[u].next_free = (u + 1 < nclients) ? u + 1 : -1;
+	}
+	free_clients = 0;
+	return 0;
+}
+
 int api_ok(){
-	if(listen_fd < 0){
+	size_t u;
+
+	if(!nlisteners){
 		fprintf(stderr, "No listening socket for API\n");
 		return 1;
 	}
+
+	//permissions apply to all unix domain sockets, regardless of option order
+	for(u = 0; u < nlisteners; u++){
+		if(!listeners[u].path){
+			continue;
+		}
+
+		if(chmod(listeners[u].path, socket_mode)){
+			fprintf(stderr, "Failed to set permissions on %s: %s\n", listeners[u].path, strerror(errno));
+			return 1;
+		}
+
+		if(socket_group != (gid_t) -1 && chown(listeners[u].path, -1, socket_group)){
+			fprintf(stderr, "Failed to set group of %s: %s\n", listeners[u].path, strerror(errno));
+			return 1;
+		}
+	}
+
+	//routes are looked up by the I/O thread, metrics are registered by the core loop only
+	if(!route_index_built){
+		api_route_index();
+	}
+
+	io_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	core_queue.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	io_queue.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	wait_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(io_epoll_fd < 0 || core_queue.wake_fd < 0 || io_queue.wake_fd < 0 || wait_timer_fd < 0){
+		fprintf(stderr, "Failed to create API I/O thread event set: %s\n", strerror(errno));
+		return 1;
+	}
+
+	snapshot_stale = 1;
+	if(api_pool_init()){
+		return 1;
+	}
+
+	for(u = 0; u < nlisteners; u++){
+		if(api_io_manage(listeners[u].fd, EPOLLIN, io_listener, u)){
+			return 1;
+		}
+	}
+
+	return api_io_manage(timer_fd, EPOLLIN, io_timer, 0)
+		|| api_io_manage(io_queue.wake_fd, EPOLLIN, io_messages, 0)
+		|| core_manage_fd(core_queue.wake_fd, EPOLLIN, api_core_event, 0)
+		|| core_manage_fd(wait_timer_fd, EPOLLIN, api_wait_timer, 0);
+}
+
+int api_loop(){
+	int error;
+
+	//nothing to serve if the API was not initialized
+	if(io_epoll_fd < 0){
+		return 0;
+	}
+
+	//published before waiting requests are answered, as for all other responses
+	if(api_publish() || (waiting && api_wait_check())){
+		return 1;
+	}
+
+	//the I/O thread is started once the catalogs and a first status snapshot are available
+	if(!io_running){
+		error = pthread_create(&io_thread, NULL, api_io_thread, NULL);
+		if(error){
+			fprintf(stderr, "Failed to start API I/O thread: %s\n", strerror(error));
+			return 1;
+		}
+		io_running = 1;
+	}
 	return 0;
 }
 
 void api_cleanup(){
+	api_message_t* message = NULL, *next = NULL;
 	size_t u;
-	if(listen_fd >= 0){
-		close(listen_fd);
+
+	//stop the I/O thread before touching any client state
+	if(io_running){
+		__atomic_store_n(&io_stop, 1, __ATOMIC_RELEASE);
+		api_queue_wake(&io_queue);
+		pthread_join(io_thread, NULL);
+	}
+	io_running = io_stop = io_failed = 0;
+
+	//queued and waiting requests are dropped along with their clients
+	waiting = NULL;
+	if(wait_timer_fd >= 0){
+		core_unmanage_fd(wait_timer_fd);
+		close(wait_timer_fd);
+	}
+	wait_timer_fd = -1;
+
+	api_queue_take(&core_queue);
+	if(core_queue.wake_fd >= 0){
+		core_unmanage_fd(core_queue.wake_fd);
+		close(core_queue.wake_fd);
+	}
+	core_queue.wake_fd = -1;
+
+	//messages may have been queued even if the thread never ran
+	for(message = api_queue_take(&io_queue); message; message = next){
+		next = message->next;
+		if(message->type != message_request){
+			api_message_free(message);
+		}
+	}
+	if(io_queue.wake_fd >= 0){
+		close(io_queue.wake_fd);
+	}
+	io_queue.wake_fd = -1;
+
+	api_message_free(status_view);
+	status_view = NULL;
+	snapshot_stale = 1;
+
+	//the generation continues, but all parts of the next status count as changed
+	api_buffer_free(&published_status);
+	free(published_slices);
+	published_slices = NULL;
+	npublished = 0;
+
+	if(io_epoll_fd >= 0){
+		close(io_epoll_fd);
+	}
+	io_epoll_fd = -1;
+
+	for(u = 0; u < nlisteners; u++){
+		close(listeners[u].fd);
+		if(listeners[u].path){
+			unlink(listeners[u].path);
+			free(listeners[u].path);
+		}
+	}
+	free(listeners);
+	listeners = NULL;
+	nlisteners = 0;
+	socket_mode = DEFAULT_SOCKET_MODE;
+	socket_group = -1;
+
+	if(timer_fd >= 0){
+		close(timer_fd);
 	}
-	listen_fd = -1;
+	timer_fd = -1;
+	timer_armed = 0;
+	keepalive_timeout = DEFAULT_KEEPALIVE;
+	request_timeout = DEFAULT_REQUEST_TIMEOUT;
+	max_clients = DEFAULT_MAX_CLIENTS;
 
 	for(u = 0; u < nclients; u++){
+		clients[u].pending = false;
+		clients[u].waiting = false;
 		api_disconnect(clients + u);
-		free(clients[u].recv_buf);
-		api_client_init(clients + u);
+		api_scratch_free(clients + u);
+		api_buffer_free(&clients[u].response);
+		free(clients[u].send_buf);
 	}
 	free(clients);
+	free(recv_pool);
 	nclients = 0;
 	clients = NULL;
+	recv_pool = NULL;
+	free_clients = -1;
+
+	//the next configuration starts a new catalog generation
+	api_buffer_free(&commands_cache);
+	api_buffer_free(&layouts_cache);
+	catalog_etag[0] = 0;
+	catalog_generation++;
 }
@@ -1,37 +1,193 @@
-#include <sys/select.h>
+#include <stdbool.h>
+#include <time.h>
+#include "metrics.h"
 
 #define RECV_CHUNK 4096
 #define LISTEN_QUEUE_LENGTH 128
 #define DEFAULT_PORT "8080"
-#define HARD_SIZE_LIMIT 10240
+#define UNIX_BIND_PREFIX "unix:"
+#define DEFAULT_SOCKET_MODE 0600
+#define DEFAULT_KEEPALIVE 15
+#define DEFAULT_REQUEST_TIMEOUT 10
+#define DEFAULT_MAX_CLIENTS 128
+//milliseconds a request may wait for a job state
+#define DEFAULT_WAIT_TIMEOUT 30000
+#define MAX_WAIT_TIMEOUT 300000
+#define TIMER_WHEEL_SLOTS 64
+#define RECV_BUFFER 10240
+#define SEND_BUFFER 16384
+#define SEND_LIMIT 262144
+#define ETAG_LENGTH 64
+#define ROUTE_BUCKETS 32
+#define ROUTE_MAX_PARAMS 2
+//browsers cache preflight results for a day
+#define CORS_PREFLIGHT_HEADERS "Access-Control-Allow-Methods: GET, POST, PUT, HEAD, OPTIONS\r\n" \
+	"Access-Control-Allow-Headers: Content-Type, If-None-Match\r\n" \
+	"Access-Control-Max-Age: 86400\r\n"
+#define ALLOW_HEADER "Allow: GET, POST, PUT, HEAD, OPTIONS\r\n"
 
 typedef enum /*_http_method*/ {
 	method_unknown = 0,
 	http_get,
-	http_post
+	http_post,
+	http_head,
+	http_options,
+	http_put
 } http_method_t;
 
 typedef enum /*_http_client_state*/ {
 	http_new = 0,
 	http_headers,
-	http_data
+	http_data,
+	http_stream,
+	http_websocket,
+	http_closing
 } http_state_t;
 
+typedef struct /*_api_listener_t*/ {
+	int fd;
+	//path of unix domain sockets, removed on cleanup
+	char* path;
+} api_listener_t;
+
+typedef struct /*_api_buffer_t*/ {
+	size_t alloc;
+	size_t length;
+	char* data;
+} api_buffer_t;
+
+//work handed between the I/O thread and the core loop
+typedef enum /*_api_message_type_t*/ {
+	message_request = 0,
+	message_event,
+	message_status
+} api_message_type_t;
+
+//part of a status rendering and the state generation it last changed in
+typedef struct /*_api_status_slice_t*/ {
+	uint64_t changed;
+	size_t offset;
+	size_t length;
+} api_status_slice_t;
+
+typedef struct _api_message_t {
+	struct _api_message_t* next;
+	api_message_type_t type;
+	//requests refer to their client slot, events and status snapshots carry their rendering
+	size_t client;
+	api_buffer_t buffer;
+	//status snapshots are split into the counts, the running commands and one slice per display
+	uint64_t generation;
+	size_t nslices;
+	api_status_slice_t* slices;
+} api_message_t;
+
+//multiple-producer single-consumer stack, drained as a whole by the consumer
+typedef struct /*_api_queue_t*/ {
+	api_message_t* head;
+	int wake_fd;
+} api_queue_t;
+
+//sources polled by the I/O thread, encoded in the epoll data along with their token
+typedef enum /*_api_io_source_t*/ {
+	io_client = 0,
+	io_listener,
+	io_timer,
+	io_messages
+} api_io_source_t;
+
 typedef struct /*_http_client*/ {
 	int fd;
+	uint32_t events;
+	//next unused slot in the client pool
+	ssize_t next_free;
 
-	size_t data_allocated;
+	//requests are parsed in place, with fields pointing into the buffer until the request is done
 	size_t recv_offset;
+	size_t scan_offset;
+	size_t line_offset;
+	size_t body_offset;
 	char* recv_buf;
 
 	size_t payload_size;
 	http_method_t method;
 	http_state_t state;
+	int keepalive;
+	//HTTP/1.1 clients accept chunked responses
+	bool chunked_ok;
+
+	//deadline in the timer wheel, 0 if none is set
+	time_t deadline;
+	ssize_t timer_prev;
+	ssize_t timer_next;
+
+	//end of the request or frame being handled, terminated in place
+	size_t request_length;
+	char request_next;
 
 	char* endpoint;
+	char* query;
+	char* if_none_match;
+	bool upgrade_websocket;
+	bool connection_upgrade;
+	char* websocket_key;
+	char* websocket_version;
+
+	//set while the core loop executes the routed request, the slot is not reused until it completes
+	bool pending;
+	api_message_t message;
+	ssize_t route;
+	char* segments[ROUTE_MAX_PARAMS + 1];
+	char* data;
+	size_t data_length;
+	//requests waiting for a job state are held by the core loop until it is reached or the deadline passes
+	bool waiting;
+	uint64_t wait_job;
+	int wait_state;
+	double wait_deadline;
+
+	//parsed WebSocket request, kept until its result is sent
+	char message_id[RECV_CHUNK / 4];
+	char* scratch;
+	void* scratch_json;
+
+	double request_start;
+	char* response_code;
+	bool response_json;
+	char* response_type;
+	char* response_etag;
+	//additional header lines
+	char* response_headers;
+	//responses built on the I/O thread may be streamed in chunks once they grow large
+	bool response_stream;
+	bool response_chunked;
+	api_buffer_t* response_cached;
+	api_buffer_t response;
+
+	size_t send_alloc;
+	size_t send_offset;
+	size_t send_length;
+	char* send_buf;
 } http_client_t;
 
-int api_loop(fd_set* in, fd_set* out, int* max_fd);
+typedef int (*api_handler)(http_client_t* client, char** params, char* data, size_t length);
+
+typedef struct /*_api_route_t*/ {
+	char* name;
+	size_t params;
+	char* missing;
+	api_handler handler;
+	//handlers only reading published snapshots run on the I/O thread
+	bool local;
+	//required method, routes without one accept GET and POST
+	http_method_t method;
+	metric_t* requests;
+} api_route_t;
+
+void api_event(char* type, char* format, ...);
+char* api_escape(char* out, size_t length, char* in);
+
 int api_config(char* option, char* value);
 int api_ok();
+int api_loop();
 void api_cleanup();
@@ -9,16 +9,28 @@
 #include <limits.h>
 #include <unistd.h>
 #include <time.h>
+#include <fcntl.h>
+#include <inttypes.h>
 
+#include "rpcd.h"
+#include "metrics.h"
 #include "x11.h"
 #include "child.h"
 #include "control.h"
+#include "api.h"
 
 static size_t ncommands = 0;
 static rpcd_child_t* commands = NULL;
 static size_t nwindows = 0;
 static rpcd_child_t* windows = NULL;
 static size_t last_command = 0;
+static size_t nwatches = 0;
+static exec_watch_t* watches = NULL;
+//bounded table of recent command instances, job ids continue across reloads
+static uint64_t last_job = 0;
+static child_job_t jobs[JOB_TABLE_SIZE];
+
+static metric_t* exec_latency = NULL;
 
 int child_active(rpcd_child_t* child){
 	return child->state != stopped;
@@ -88,6 +100,50 @@ int child_stop_commands(size_t display_id){
 	return rv;
 }
 
+child_job_t* child_job_find(uint64_t id){
+	//older jobs have been replaced by newer ones
+	if(!id || id > last_job || id + JOB_TABLE_SIZE <= last_job || jobs[id % JOB_TABLE_SIZE].id != id){
+		return NULL;
+	}
+	return jobs + (id % JOB_TABLE_SIZE);
+}
+
+static uint64_t child_job_new(rpcd_child_t* child, double started){
+	child_job_t* job = jobs + (++last_job % JOB_TABLE_SIZE);
+	child_job_t empty = {
+		0
+	};
+
+	free(job->name);
+	*job = empty;
+	job->id = last_job;
+	job->name = strdup(child->name);
+	job->state = job_started;
+	job->pid = child->instance;
+	job->start_time = time(NULL);
+	job->started = started;
+	job->mapped = -1;
+	return job->id;
+}
+
+static void child_job_exit(rpcd_child_t* child, int wait_status){
+	child_job_t* job = child_job_find(child->job);
+
+	if(!job){
+		return;
+	}
+
+	job->state = job_exited;
+	job->runtime = metrics_time() - job->started;
+	if(WIFSIGNALED(wait_status)){
+		job->signal = WTERMSIG(wait_status);
+		job->exit_code = -job->signal;
+	}
+	else{
+		job->exit_code = WEXITSTATUS(wait_status);
+	}
+}
+
 int child_reap(){
 	int wait_status;
 	pid_t status;
@@ -105,6 +161,7 @@ int child_reap(){
 			for(u = 0; u < ncommands; u++){
 				if(commands[u].state != stopped && commands[u].instance == status){
 					commands[u].state = stopped;
+					child_job_exit(commands + u, wait_status);
 					//if restore requested, undo layout change
 					if(commands[u].restore_layout){
 						x11_rollback(commands[u].display_id);
@@ -116,6 +173,7 @@ int child_reap(){
 						commands[u].frame_id = -1;
 					}
 					fprintf(stderr, "Instance of %s stopped\n", commands[u].name);
+					api_event("stop", "{\"command\":\"%s\",\"job\":%" PRIu64 "}", commands[u].name, commands[u].job);
 					break;
 				}
 			}
@@ -124,6 +182,7 @@ int child_reap(){
 				if(windows[u].state != stopped && windows[u].instance == status){
 					windows[u].state = stopped;
 					fprintf(stderr, "Automated window %s terminated\n", windows[u].name);
+					api_event("stop", "{\"window\":\"%s\"}", windows[u].name ? windows[u].name : "");
 					break;
 				}
 			}
@@ -275,8 +334,78 @@ random_sleep()
 	usleep(sleeptime);
 }
 
+static int child_exec_event(int fd, uint32_t events, size_t token){
+	double exec_started;
+	ssize_t bytes = read(fd, &exec_started, sizeof(exec_started));
+	child_job_t* job = NULL;
+
+	if(bytes < 0 && errno == EAGAIN){
+		return 0;
+	}
+
+	//the child reports the end of its startup delay, the latency is measured from there
+	if(bytes == sizeof(exec_started)){
+		if(token < nwatches && watches[token].fd == fd){
+			watches[token].started = exec_started;
+		}
+		return 0;
+	}
+
+	//hangup means the child has either executed or given up
+	if(token < nwatches && watches[token].fd == fd){
+		metrics_observe(exec_latency, metrics_time() - watches[token].started);
+		watches[token].fd = -1;
+
+		job = child_job_find(watches[token].job);
+		if(job && job->state == job_started){
+			job->state = job_running;
+		}
+	}
+	core_unmanage_fd(fd);
+	close(fd);
+	return 0;
+}
+
+static void child_watch_exec(int fd, double started, uint64_t job){
+	size_t u;
+
+	for(u = 0; u < nwatches; u++){
+		if(watches[u].fd < 0){
+			break;
+		}
+	}
+
+	if(u == nwatches){
+		watches = realloc(watches, (nwatches + 1) * sizeof(exec_watch_t));
+		if(!watches){
+			fprintf(stderr, "Failed to allocate memory\n");
+			nwatches = 0;
+			close(fd);
+			return;
+		}
+		nwatches++;
+	}
+
+	watches[u].fd = fd;
+	watches[u].started = started;
+	watches[u].job = job;
+	if(core_manage_fd(fd, EPOLLIN, child_exec_event, u)){
+		watches[u].fd = -1;
+		close(fd);
+	}
+}
+
 int child_start(rpcd_child_t* child, size_t display_id, size_t frame_id, command_instance_t* instance_args){
 	display_t* display = NULL;
+	sigset_t signal_mask;
+	int exec_pipe[2] = {
+		-1, -1
+	};
+	double started;
+
+	if(!exec_latency){
+		exec_latency = metrics_register(metric_histogram, "rpcd_child_exec_seconds", "Time from the end of the startup delay to exec of child processes", NULL);
+	}
 
 	child->order = child_restack();
 	child->display_id = display_id;
@@ -292,9 +421,23 @@ int child_start(rpcd_child_t* child, size_t display_id, size_t frame_id, command
 		}
 	}
 
+	//the write end closes on exec, which the core loop notices on the read end
+	if(pipe(exec_pipe)){
+		fprintf(stderr, "Failed to create exec notification pipe: %s\n", strerror(errno));
+		exec_pipe[0] = exec_pipe[1] = -1;
+	}
+	else{
+		fcntl(exec_pipe[0], F_SETFD, FD_CLOEXEC);
+		fcntl(exec_pipe[1], F_SETFD, FD_CLOEXEC);
+	}
+
+	started = metrics_time();
 	child->instance = fork();
 	switch(child->instance){
 		case 0:
+			//the core loop blocks signals in favor of a signalfd, which the signal mask of the new process inherits
+			sigemptyset(&signal_mask);
+			sigprocmask(SIG_SETMASK, &signal_mask, NULL);
 			//update the environment with proper DISPLAY
 			if(child->mode != user_no_windows){
 				if(setenv("DISPLAY", display->identifier, 1)){
@@ -315,6 +458,13 @@ int child_start(rpcd_child_t* child, size_t display_id, size_t frame_id, command
 			}
 
 			random_sleep();
+			//the exec latency does not include the startup delay
+			if(exec_pipe[1] >= 0){
+				started = metrics_time();
+				if(write(exec_pipe[1], &started, sizeof(started)) < 0){
+					fprintf(stderr, "Failed to report exec start: %s\n", strerror(errno));
+				}
+			}
 			//handle with appropriate child procedure
 			if(child->mode == user || child->mode == user_no_windows){
 				child_command_proc(child, instance_args);
@@ -326,12 +476,28 @@ int child_start(rpcd_child_t* child, size_t display_id, size_t frame_id, command
 			exit(EXIT_FAILURE);
 		case -1:
 			fprintf(stderr, "Failed to spawn child process for command %s: %s\n", child->name, strerror(errno));
+			if(exec_pipe[0] >= 0){
+				close(exec_pipe[0]);
+				close(exec_pipe[1]);
+			}
 			return 1;
 		default:
+			//only commands are tracked as jobs, windows are restarted by the automation
+			child->job = (child->mode == user || child->mode == user_no_windows) ? child_job_new(child, started) : 0;
+			if(exec_pipe[0] >= 0){
+				close(exec_pipe[1]);
+				child_watch_exec(exec_pipe[0], started, child->job);
+			}
 			if(child->mode == user){
 				x11_lock(child->display_id);
 			}
 			child->state = running;
+			if(child->mode == user || child->mode == user_no_windows){
+				api_event("start", "{\"command\":\"%s\",\"job\":%" PRIu64 "}", child->name, child->job);
+			}
+			else{
+				api_event("start", "{\"window\":\"%s\"}", child->name ? child->name : "");
+			}
 	}
 	return 0;
 }
@@ -473,8 +639,9 @@ done:
 	return rv;
 }
 
-int child_match_window(size_t display_id, Window window, pid_t pid, char* title, char* name, char* class){
+int child_match_window(size_t display_id, xcb_window_t window, pid_t pid, char* title, char* name, char* class){
 	rpcd_child_t* match = NULL;
+	child_job_t* job = NULL;
 	pid_t current_pid = pid;
 	size_t u, matched = 0;
 	enum {
@@ -552,7 +719,7 @@ int child_match_window(size_t display_id, Window window, pid_t pid, char* title,
 	}
 
 	if(matched){
-		match->windows = realloc(match->windows, (match->nwindows + 1) * sizeof(Window));
+		match->windows = realloc(match->windows, (match->nwindows + 1) * sizeof(xcb_window_t));
 		if(!match->windows){
 			match->nwindows = 0;
 			fprintf(stderr, "Failed to allocate memory\n");
@@ -561,9 +728,17 @@ int child_match_window(size_t display_id, Window window, pid_t pid, char* title,
 		match->windows[match->nwindows] = window;
 		match->nwindows++;
 
-		fprintf(stderr, "Matched window %zu (%d, %s, %s, %s) on display %zu to child %zu (%s) using strategy %u, now at %zu windows\n",
+		job = child_job_find(match->job);
+		if(job && job->state < job_mapped){
+			job->state = job_mapped;
+			job->mapped = metrics_time() - job->started;
+		}
+
+		fprintf(stderr, "Matched window %u (%d, %s, %s, %s) on display %zu to child %zu (%s) using strategy %u, now at %zu windows\n",
 				window, pid, title ? title : "-none-", name ? name : "-none-",
 				class ? class : "-none-", display_id, u, match->name, strategy, match->nwindows);
+		api_event("map", "{\"display\":\"%s\",\"window\":%u,\"child\":\"%s\"}",
+				x11_get(display_id)->name, window, match->name ? match->name : "");
 
 		//run automation if an automated window was mapped
 		if(match->mode != user && match->mode != user_no_windows){
@@ -572,12 +747,12 @@ int child_match_window(size_t display_id, Window window, pid_t pid, char* title,
 		return 0;
 	}
 
-	fprintf(stderr, "Failed to match window %zu (%d, %s, %s, %s) on display %zu to executing child\n", window, pid, title ? title : "-none-",
+	fprintf(stderr, "Failed to match window %u (%d, %s, %s, %s) on display %zu to executing child\n", window, pid, title ? title : "-none-",
 			name ? name : "-none-", class ? class : "-none-", display_id);
 	return 0;
 }
 
-int child_discard_window(size_t display_id, Window window){
+int child_discard_window(size_t display_id, xcb_window_t window){
 	size_t u, c;
 	rpcd_child_t* check = NULL;
 
@@ -595,14 +770,16 @@ int child_discard_window(size_t display_id, Window window){
 					}
 
 					check->nwindows--;
-					fprintf(stderr, "Dismissed window %zu for command %s, %zu left\n", window, check->name ? check->name : "-repatriated-", check->nwindows);
+					fprintf(stderr, "Dismissed window %u for command %s, %zu left\n", window, check->name ? check->name : "-repatriated-", check->nwindows);
+					api_event("unmap", "{\"display\":\"%s\",\"window\":%u,\"child\":\"%s\"}",
+							x11_get(display_id)->name, window, check->name ? check->name : "");
 					return 0;
 				}
 			}
 		}
 	}
 
-	fprintf(stderr, "Unmatched window %zu destroyed on display %zu\n", window, display_id);
+	fprintf(stderr, "Unmatched window %u destroyed on display %zu\n", window, display_id);
 	return 0;
 }
 
@@ -640,7 +817,7 @@ rpcd_child_t* child_occupant(size_t display_id, size_t frame_id){
 	return matched_child;
 }
 
-Window child_window(size_t display_id, size_t frame_id){
+xcb_window_t child_window(size_t display_id, size_t frame_id){
 	rpcd_child_t* child = child_occupant(display_id, frame_id);
 	if(child){
 		return child->windows[child->nwindows - 1];
@@ -673,7 +850,7 @@ static rpcd_child_t* child_allocate_window(){
 	return windows + nwindows++;
 }
 
-int child_repatriate(size_t display_id, size_t frame_id, Window window){
+int child_repatriate(size_t display_id, size_t frame_id, xcb_window_t window){
 	rpcd_child_t* rep = child_allocate_window();
 
 	if(!rep){
@@ -681,7 +858,7 @@ int child_repatriate(size_t display_id, size_t frame_id, Window window){
 	}
 
 	//order implicitly set to 0
-	rep->windows = malloc(sizeof(Window));
+	rep->windows = malloc(sizeof(xcb_window_t));
 	if(!rep->windows){
 		fprintf(stderr, "Failed to allocate memory\n");
 		//implicitly forget the window
@@ -968,4 +1145,20 @@ void child_cleanup(){
 	free(windows);
 	nwindows = 0;
 	windows = NULL;
+
+	for(u = 0; u < nwatches; u++){
+		if(watches[u].fd >= 0){
+			core_unmanage_fd(watches[u].fd);
+			close(watches[u].fd);
+		}
+	}
+	free(watches);
+	nwatches = 0;
+	watches = NULL;
+
+	for(u = 0; u < JOB_TABLE_SIZE; u++){
+		free(jobs[u].name);
+		jobs[u].name = NULL;
+		jobs[u].id = 0;
+	}
 }
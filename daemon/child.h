@@ -1,10 +1,42 @@
-#include <X11/Xlib.h>
+#include <stdint.h>
+#include <xcb/xcb.h>
+
+#define JOB_TABLE_SIZE 64
 
 typedef enum /*_user_command_arg_type_t*/ {
 	arg_string,
 	arg_enum
 } argument_type;
 
+//pending exec of a forked child, signalled by its close-on-exec pipe closing
+typedef struct /*_child_exec_watch_t*/ {
+	int fd;
+	double started;
+	uint64_t job;
+} exec_watch_t;
+
+//lifecycle of a command instance, ordered by progress
+typedef enum /*_child_job_state_t*/ {
+	job_none = 0,
+	job_started, /*forked*/
+	job_running, /*executed*/
+	job_mapped, /*first window mapped*/
+	job_exited
+} job_state_t;
+
+typedef struct /*_child_job_t*/ {
+	uint64_t id;
+	char* name; /*command name*/
+	job_state_t state;
+	pid_t pid;
+	time_t start_time; /*wall clock time of the start*/
+	double started; /*monotonic time of the start*/
+	double mapped; /*time to the first mapped window, negative if none*/
+	double runtime; /*time from start to exit*/
+	int exit_code; /*exit code, negative if terminated by a signal*/
+	int signal; /*terminating signal*/
+} child_job_t;
+
 typedef enum /*_instance_state*/ {
 	stopped = 0,
 	running,
@@ -47,12 +79,13 @@ typedef struct /*_rpcd_child_t*/ {
 	size_t display_id; /*active display*/
 	ssize_t frame_id; /*active frame*/
 	size_t nwindows; /*number of displayed windows*/
-	Window* windows; /*window handles*/
+	xcb_window_t* windows; /*window handles*/
 	char* filters[3]; /*title, app name, class name filters*/
 
 	/*process control attributes*/
 	instance_state state; /*process lifecycle state*/
 	pid_t instance; /*process id*/
+	uint64_t job; /*job of the current instance, 0 for windows*/
 } rpcd_child_t;
 
 typedef struct /*_user_command_instance_cfg*/ {
@@ -68,12 +101,13 @@ int child_raise(rpcd_child_t* child, size_t display_id, size_t frame_id);
 int child_stop(rpcd_child_t* child);
 int child_stop_commands(size_t display_id);
 int child_reap();
+child_job_t* child_job_find(uint64_t id);
 
-int child_match_window(size_t display_id, Window window, pid_t pid, char* title, char* res_name, char* res_class);
-int child_discard_window(size_t display_id, Window window);
+int child_match_window(size_t display_id, xcb_window_t window, pid_t pid, char* title, char* res_name, char* res_class);
+int child_discard_window(size_t display_id, xcb_window_t window);
 rpcd_child_t* child_occupant(size_t display_id, size_t frame_id);
-Window child_window(size_t display_id, size_t frame_id);
-int child_repatriate(size_t display_id, size_t frame_id, Window window);
+xcb_window_t child_window(size_t display_id, size_t frame_id);
+int child_repatriate(size_t display_id, size_t frame_id, xcb_window_t window);
 
 size_t child_command_count();
 rpcd_child_t* child_command_get(size_t index);
@@ -1,3 +1,4 @@
+#include "rpcd.h"
 #include "control.h"
 #include <string.h>
 #include <stdio.h>
@@ -11,7 +12,9 @@
 #include <errno.h>
 #include <ctype.h>
 
+#include "metrics.h"
 #include "child.h"
+#include "api.h"
 
 static size_t init_done = 0;
 
@@ -28,6 +31,10 @@ static display_config_t* display_status = NULL;
 static size_t nassign = 0;
 static automation_assign_t* assign = NULL;
 
+static metric_t* automation_runs = NULL;
+static metric_t* automation_duration = NULL;
+static metric_t* window_restarts = NULL;
+
 static ssize_t control_variable_find(char* name){
 	ssize_t u;
 
@@ -40,6 +47,8 @@ static ssize_t control_variable_find(char* name){
 	return -1;
 }
 
+static int control_event(int fd, uint32_t events, size_t token);
+
 static int control_input(input_type_t type, int fd){
 	size_t u;
 	control_input_t new_input = {
@@ -68,10 +77,11 @@ static int control_input(input_type_t type, int fd){
 	}
 
 	fds[u] = new_input;
-	return 0;
+	return core_manage_fd(fd, EPOLLIN, control_event, u);
 }
 
 static int control_close(control_input_t* client){
+	core_unmanage_fd(client->fd);
 	close(client->fd);
 	client->fd = -1;
 	client->recv_offset = 0;
@@ -141,6 +151,7 @@ static int control_accept(control_input_t* sock){
 static int control_command(char* command){
 	ssize_t var;
 	char* sep = NULL;
+	char escaped[RECV_CHUNK / 2];
 	if(!strchr(command, '=')){
 		fprintf(stderr, "Invalid control command received: %s\n", command);
 		return 1;
@@ -167,6 +178,8 @@ static int control_command(char* command){
 		return 1;
 	}
 
+	api_event("variable", "{\"name\":\"%s\",\"value\":\"%s\"}", vars[var].name,
+			api_escape(escaped, sizeof(escaped), vars[var].value));
 	return control_run_automation();
 }
 
@@ -233,6 +246,22 @@ static int control_data(control_input_t* client){
 	return 0;
 }
 
+static int control_event(int fd, uint32_t events, size_t token){
+	if(token >= nfds || fds[token].fd != fd){
+		fprintf(stderr, "Stale control input event on fd %d\n", fd);
+		return 0;
+	}
+
+	switch(fds[token].type){
+		case control_socket:
+			return control_accept(fds + token);
+		case control_fifo:
+		case control_client:
+			return control_data(fds + token);
+	}
+	return 0;
+}
+
 int control_config(char* option, char* value){
 	if(!strcmp(option, "socket")){
 		return control_new_socket(value);
@@ -366,8 +395,34 @@ static int control_build_environment(command_instance_t* inst){
 	return 0;
 }
 
+int control_start_window(char* name, size_t display_id, size_t frame_id){
+	size_t u;
+	int rv = 1;
+	rpcd_child_t* window = child_window_find(name);
+	command_instance_t instance_env = {
+		0
+	};
+
+	if(!window){
+		fprintf(stderr, "No such window %s\n", name);
+		return 1;
+	}
+
+	//windows started outside of automation see the same variables
+	if(!nvars || !control_build_environment(&instance_env)){
+		rv = child_start(window, display_id, frame_id, &instance_env);
+	}
+
+	for(u = 0; instance_env.arguments && u < instance_env.nargs; u++){
+		free(instance_env.arguments[u]);
+	}
+	free(instance_env.arguments);
+	return rv;
+}
+
 int control_run_automation(){
 	size_t u, p, active_assigns = 0, done;
+	double started = metrics_time();
 	int rv = 0;
 	automation_operation_t* op = NULL;
 	rpcd_child_t* window = NULL, *occupant = NULL;
@@ -389,6 +444,13 @@ int control_run_automation(){
 		}
 	}
 
+	if(!automation_runs){
+		automation_runs = metrics_register(metric_counter, "rpcd_automation_runs_total", "Automation script executions", NULL);
+		automation_duration = metrics_register(metric_histogram, "rpcd_automation_duration_seconds", "Automation script execution time", NULL);
+		window_restarts = metrics_register(metric_counter, "rpcd_child_restarts_total", "Windows restarted by the automation after terminating on their own", NULL);
+	}
+	metrics_increment(automation_runs);
+
 	//set initial display states
 	for(u = 0; u < x11_count(); u++){
 		display_status[u].display = x11_get(u);
@@ -491,6 +553,10 @@ apply_results:
 			}
 
 			fprintf(stderr, "Automation starting window %s, iteration %zu\n", window->name, window->start_iteration);
+			//stopping a window resets its iterations, so it has terminated by itself
+			if(window->start_iteration){
+				metrics_increment(window_restarts);
+			}
 			child_start(window, assign[u].display_id, assign[u].frame_id, &instance_env);
 			//wait for window
 			display_status[assign[u].display_id].status = display_waiting;
@@ -518,7 +584,7 @@ apply_results:
 	for(u = 0; u < x11_count(); u++){
 		if(display_status[u].status == display_ready
 				&& display_status[u].layout){
-			//TODO use damage tracking to apply the layout only if it changes
+			//only sent to ratpoison if the frames or their windows changed
 			if(x11_activate_layout(display_status[u].layout)){
 				fprintf(stderr, "Automation failed to activate layout %s on display %zu, exiting\n", display_status[u].layout->name, u);
 				rv = 1;
@@ -533,6 +599,7 @@ cleanup:
 		free(instance_env.arguments[u]);
 	}
 	free(instance_env.arguments);
+	metrics_observe(automation_duration, metrics_time() - started);
 	return rv;
 }
 
@@ -764,7 +831,7 @@ int control_config_automation(char* line){
 	return 1;
 }
 
-int control_loop(fd_set* in, fd_set* out, int* max_fd){
+int control_loop(){
 	size_t u;
 	command_instance_t env = {
 		0
@@ -796,29 +863,6 @@ int control_loop(fd_set* in, fd_set* out, int* max_fd){
 		free(env.arguments);
 	}
 
-	for(u = 0; u < nfds; u++){
-		if(fds[u].fd >= 0 && FD_ISSET(fds[u].fd, in)){
-			switch(fds[u].type){
-				case control_socket:
-					if(control_accept(fds + u)){
-						return 1;
-					}
-					break;
-				case control_fifo:
-				case control_client:
-					if(control_data(fds + u)){
-						return 1;
-					}
-					break;
-			}
-		}
-
-		//push all our fds to the core loop
-		if(fds[u].fd >= 0){
-			*max_fd = (*max_fd > fds[u].fd) ? *max_fd : fds[u].fd;
-			FD_SET(fds[u].fd, out);
-		}
-	}
 	return 0;
 }
 
@@ -843,6 +887,7 @@ void control_cleanup(){
 
 	for(u = 0; u < nfds; u++){
 		if(fds[u].fd >= 0){
+			core_unmanage_fd(fds[u].fd);
 			close(fds[u].fd);
 		}
 		free(fds[u].recv_buffer);
@@ -1,4 +1,3 @@
-#include <X11/Xlib.h>
 #define LISTEN_QUEUE_LENGTH 128
 #define CLIENT_RECV_CHUNK 2048
 #define CLIENT_RECV_LIMIT 8192
@@ -73,7 +72,8 @@ typedef struct /*_automation_op_t*/ {
 int control_config(char* option, char* value);
 int control_config_variable(char* name, char* value);
 int control_config_automation(char* line);
-int control_loop(fd_set* in, fd_set* out, int* max_fd);
+int control_loop();
 int control_run_automation();
+int control_start_window(char* name, size_t display_id, size_t frame_id);
 int control_ok();
 void control_cleanup();
@@ -37,6 +37,71 @@ layout_t* layout_find(size_t display_id, char* name){
 	return NULL;
 }
 
+void layout_set_window(layout_t* layout, size_t frame, size_t window){
+	char* slot = layout->restore + layout->window_slots[frame];
+	size_t u = LAYOUT_WINDOW_SLOT;
+
+	layout->windows[frame] = window;
+
+	//fill the slot from the right, ratpoison skips the leading blanks
+	do{
+		slot[--u] = '0' + window % 10;
+		window /= 10;
+	}
+	while(window && u);
+	memset(slot, ' ', u);
+}
+
+static int layout_compile(layout_t* layout){
+	size_t frame, size = 0, off;
+	int pass, required;
+
+	//geometry is static after configuration, the first pass measures the template
+	//and the second one writes it with the window slots left blank.
+	//the template starts with the interactive flag, so it can be queued as is
+	for(pass = 0; pass < 2; pass++){
+		if(pass){
+			size = off + 1;
+			layout->restore = calloc(size, sizeof(char));
+			layout->window_slots = calloc(layout->nframes, sizeof(size_t));
+			layout->windows = calloc(layout->nframes, sizeof(size_t));
+			if(!layout->restore || !layout->window_slots || !layout->windows){
+				fprintf(stderr, "Failed to allocate memory\n");
+				return 1;
+			}
+			memcpy(layout->restore + 1, "sfrestore ", 10);
+			layout->restore_length = size;
+		}
+
+		for(frame = 0, off = 11; frame < layout->nframes; frame++){
+			required = snprintf(pass ? layout->restore + off : NULL, pass ? size - off : 0,
+					"%s(frame :number %zu :x %zu :y %zu :width %zu :height %zu :screenw %zu :screenh %zu :window %*s",
+					frame ? "," : "", layout->frames[frame].id,
+					layout->frames[frame].bbox[0], layout->frames[frame].bbox[1],
+					layout->frames[frame].bbox[2], layout->frames[frame].bbox[3],
+					layout->frames[frame].screen[0], layout->frames[frame].screen[1],
+					LAYOUT_WINDOW_SLOT, "");
+			if(required < 0){
+				fprintf(stderr, "Failed to design layout string for %s\n", layout->name);
+				return 1;
+			}
+
+			off += required;
+			if(pass){
+				layout->window_slots[frame] = off - LAYOUT_WINDOW_SLOT;
+			}
+
+			required = snprintf(pass ? layout->restore + off : NULL, pass ? size - off : 0, ") %zu", layout->frames[frame].screen[2]);
+			if(required < 0){
+				fprintf(stderr, "Failed to design layout string for %s\n", layout->name);
+				return 1;
+			}
+			off += required;
+		}
+	}
+	return 0;
+}
+
 static int layout_parse(char* layout_string, size_t len, layout_t* layout){
 	size_t u, p;
 	int rv = 1;
@@ -159,7 +224,11 @@ static int layout_init(layout_t* layout, char* name, size_t display_id){
 		.max_screen = 0,
 		.nframes = 0,
 		.frames = NULL,
-		.display_id = display_id
+		.display_id = display_id,
+		.restore = NULL,
+		.restore_length = 0,
+		.window_slots = NULL,
+		.windows = NULL
 	};
 	*layout = empty;
 	return 0;
@@ -168,6 +237,9 @@ static int layout_init(layout_t* layout, char* name, size_t display_id){
 static void layout_free(layout_t* layout){
 	free(layout->name);
 	free(layout->frames);
+	free(layout->restore);
+	free(layout->window_slots);
+	free(layout->windows);
 	layout_init(layout, NULL, 0);
 }
 
@@ -250,7 +322,7 @@ int layout_ok(){
 		return 1;
 	}
 
-	return 0;
+	return layout->restore ? 0 : layout_compile(layout);
 }
 
 void layout_cleanup(){
@@ -1,5 +1,9 @@
 #ifndef RPCD_LAYOUT_H
 #define RPCD_LAYOUT_H
+#include <stddef.h>
+
+//window IDs are right-aligned into fixed width fields of the restore template
+#define LAYOUT_WINDOW_SLOT 20
 
 typedef struct /*_ratpoison_layout_frame*/ {
 	size_t id;
@@ -13,11 +17,18 @@ typedef struct /*_ratpoison_layout_t*/ {
 	size_t max_screen;
 	frame_t* frames;
 	size_t display_id;
+
+	//precompiled sfrestore command in RP_COMMAND format, only the window slots change on activation
+	char* restore;
+	size_t restore_length;
+	size_t* window_slots;
+	size_t* windows;
 } layout_t;
 
 size_t layout_count();
 layout_t* layout_get(size_t index);
 layout_t* layout_find(size_t display_id, char* name);
+void layout_set_window(layout_t* layout, size_t frame, size_t window);
 
 int layout_new(char* name);
 int layout_config(char* option, char* value);
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "metrics.h"
+
+//histogram bucket upper bounds in seconds, shared by all histograms
+const double metrics_bounds[METRICS_BUCKETS] = {
+	0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+	0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+//the registry is static and survives configuration reloads, keeping counters monotonic
+//metrics are only registered by the core loop, but updated and read from the API I/O thread as well
+static size_t nmetrics = 0;
+static metric_t metrics[METRICS_MAX];
+
+size_t metrics_count(){
+	return __atomic_load_n(&nmetrics, __ATOMIC_ACQUIRE);
+}
+
+metric_t* metrics_get(size_t index){
+	if(index < metrics_count()){
+		return metrics + index;
+	}
+	return NULL;
+}
+
+metric_t* metrics_register(metric_type_t type, char* name, char* help, char* labels){
+	metric_t empty_metric = {
+		.type = type,
+		.name = name,
+		.help = help
+	};
+
+	if(nmetrics == METRICS_MAX){
+		fprintf(stderr, "Metrics registry full, not recording %s\n", name);
+		return NULL;
+	}
+
+	metrics[nmetrics] = empty_metric;
+	if(labels){
+		strncpy(metrics[nmetrics].labels, labels, sizeof(metrics[nmetrics].labels) - 1);
+	}
+	//publish the entry only once it is complete
+	__atomic_store_n(&nmetrics, nmetrics + 1, __ATOMIC_RELEASE);
+	return metrics + nmetrics - 1;
+}
+
+void metrics_increment(metric_t* metric){
+	if(metric){
+		__atomic_fetch_add(&metric->value, 1, __ATOMIC_RELAXED);
+	}
+}
+
+void metrics_observe(metric_t* metric, double value){
+	double sum, updated;
+	size_t u;
+
+	if(!metric){
+		return;
+	}
+
+	for(u = 0; u < METRICS_BUCKETS; u++){
+		if(value <= metrics_bounds[u]){
+			__atomic_fetch_add(metric->buckets + u, 1, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+	__atomic_fetch_add(&metric->value, 1, __ATOMIC_RELAXED);
+
+	__atomic_load(&metric->sum, &sum, __ATOMIC_RELAXED);
+	do{
+		updated = sum + value;
+	}
+	while(!__atomic_compare_exchange(&metric->sum, &sum, &updated, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+uint64_t metrics_value(metric_t* metric){
+	return __atomic_load_n(&metric->value, __ATOMIC_RELAXED);
+}
+
+uint64_t metrics_bucket(metric_t* metric, size_t bucket){
+	return __atomic_load_n(metric->buckets + bucket, __ATOMIC_RELAXED);
+}
+
+double metrics_sum(metric_t* metric){
+	double sum;
+	__atomic_load(&metric->sum, &sum, __ATOMIC_RELAXED);
+	return sum;
+}
+
+double metrics_time(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
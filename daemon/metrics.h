@@ -0,0 +1,38 @@
+#ifndef RPCD_METRICS_H
+#define RPCD_METRICS_H
+#include <stdint.h>
+#include <stddef.h>
+
+#define METRICS_MAX 64
+#define METRICS_BUCKETS 16
+#define METRICS_LABEL_LENGTH 128
+
+typedef enum /*_metric_type_t*/ {
+	metric_counter = 0,
+	metric_histogram
+} metric_type_t;
+
+typedef struct /*_metric_t*/ {
+	metric_type_t type;
+	char* name;
+	char* help;
+	char labels[METRICS_LABEL_LENGTH];
+	//counter value or number of histogram samples
+	uint64_t value;
+	double sum;
+	uint64_t buckets[METRICS_BUCKETS];
+} metric_t;
+
+extern const double metrics_bounds[METRICS_BUCKETS];
+
+size_t metrics_count();
+metric_t* metrics_get(size_t index);
+
+metric_t* metrics_register(metric_type_t type, char* name, char* help, char* labels);
+void metrics_increment(metric_t* metric);
+void metrics_observe(metric_t* metric, double value);
+uint64_t metrics_value(metric_t* metric);
+uint64_t metrics_bucket(metric_t* metric, size_t bucket);
+double metrics_sum(metric_t* metric);
+double metrics_time();
+#endif
@@ -1,8 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
-#include <sys/select.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 
 #include "rpcd.h"
 #include "config.h"
@@ -14,22 +17,194 @@
 #include "control.h"
 
 volatile sig_atomic_t shutdown_requested = 0;
-static volatile sig_atomic_t pid_signaled = 0;
-static volatile sig_atomic_t reload_requested = 3;
-
-static void signal_handler(int signum){
-	switch(signum){
-		case SIGINT:
-		case SIGTERM:
-			shutdown_requested = 1;
-			break;
-		case SIGHUP:
-			reload_requested = reload_requested ? 3 : 1; //1 -> requested, 2 -> acknowledged, 3 -> forced
-			break;
-		case SIGCHLD:
-			pid_signaled = 1;
-			break;
+static int pid_signaled = 0;
+static int reload_requested = 3;
+
+static int epoll_fd = -1;
+static int signal_fd = -1;
+static size_t nmanaged = 0;
+static managed_fd_t* managed = NULL;
+
+int core_manage_fd(int fd, uint32_t events, core_callback handler, size_t token){
+	struct epoll_event ev = {
+		.events = events,
+		.data.fd = fd
+	};
+	size_t u;
+	int op = EPOLL_CTL_ADD;
+
+	if(fd < 0 || !handler){
+		fprintf(stderr, "Invalid fd registration with the core loop\n");
+		return 1;
+	}
+
+	//the handler table is indexed by fd, extend it as required
+	if(fd >= nmanaged){
+		managed = realloc(managed, (fd + 1) * sizeof(managed_fd_t));
+		if(!managed){
+			fprintf(stderr, "Failed to allocate memory\n");
+			nmanaged = 0;
+			return 1;
+		}
+
+		for(u = nmanaged; u <= fd; u++){
+			managed[u].handler = NULL;
+			managed[u].token = 0;
+			managed[u].events = 0;
+		}
+		nmanaged = fd + 1;
+	}
+
+	if(managed[fd].handler){
+		op = EPOLL_CTL_MOD;
+	}
+
+	if(epoll_ctl(epoll_fd, op, fd, &ev)){
+		fprintf(stderr, "Failed to register fd %d with the core loop: %s\n", fd, strerror(errno));
+		return 1;
+	}
+
+	managed[fd].handler = handler;
+	managed[fd].token = token;
+	managed[fd].events = events;
+	return 0;
+}
+
+int core_update_fd(int fd, uint32_t events){
+	struct epoll_event ev = {
+		.events = events,
+		.data.fd = fd
+	};
+
+	if(fd < 0 || fd >= nmanaged || !managed[fd].handler){
+		fprintf(stderr, "Event mask update for unmanaged fd %d\n", fd);
+		return 1;
+	}
+
+	if(managed[fd].events == events){
+		return 0;
+	}
+
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev)){
+		fprintf(stderr, "Failed to update fd %d in the core loop: %s\n", fd, strerror(errno));
+		return 1;
+	}
+
+	managed[fd].events = events;
+	return 0;
+}
+
+int core_unmanage_fd(int fd){
+	if(fd < 0 || fd >= nmanaged || !managed[fd].handler){
+		return 0;
+	}
+
+	//this may fail if the fd was already closed, which implicitly removes it from the set
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	managed[fd].handler = NULL;
+	managed[fd].token = 0;
+	managed[fd].events = 0;
+	return 0;
+}
+
+static int core_signal(int fd, uint32_t events, size_t token){
+	struct signalfd_siginfo info;
+	ssize_t bytes;
+
+	for(bytes = read(fd, &info, sizeof(info)); bytes == sizeof(info); bytes = read(fd, &info, sizeof(info))){
+		switch(info.ssi_signo){
+			case SIGINT:
+			case SIGTERM:
+				shutdown_requested = 1;
+				break;
+			case SIGHUP:
+				reload_requested = reload_requested ? 3 : 1; //1 -> requested, 2 -> acknowledged, 3 -> forced
+				break;
+			case SIGCHLD:
+				pid_signaled = 1;
+				break;
+		}
+	}
+
+	if(bytes < 0 && errno != EAGAIN){
+		fprintf(stderr, "Failed to read from signalfd: %s\n", strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+static int core_init(){
+	sigset_t mask;
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(epoll_fd < 0){
+		fprintf(stderr, "Failed to create core event set: %s\n", strerror(errno));
+		return 1;
+	}
+
+	//signals are handled synchronously via the core loop, children restore the mask before exec
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGHUP);
+	if(sigprocmask(SIG_BLOCK, &mask, NULL)){
+		fprintf(stderr, "Failed to block signals: %s\n", strerror(errno));
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if(signal_fd < 0){
+		fprintf(stderr, "Failed to create signalfd: %s\n", strerror(errno));
+		return 1;
+	}
+
+	return core_manage_fd(signal_fd, EPOLLIN, core_signal, 0);
+}
+
+static int core_wait(){
+	struct epoll_event events[CORE_MAX_EVENTS];
+	int ready, u, fd;
+
+	ready = epoll_wait(epoll_fd, events, CORE_MAX_EVENTS, -1);
+	if(ready < 0){
+		if(errno == EINTR){
+			return 0;
+		}
+		fprintf(stderr, "epoll_wait() failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	for(u = 0; u < ready; u++){
+		fd = events[u].data.fd;
+		//handlers earlier in this batch may have unregistered the fd
+		if(fd >= nmanaged || !managed[fd].handler){
+			continue;
+		}
+
+		if(managed[fd].handler(fd, events[u].events, managed[fd].token)){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void core_cleanup(){
+	if(signal_fd >= 0){
+		core_unmanage_fd(signal_fd);
+		close(signal_fd);
+	}
+	signal_fd = -1;
+
+	if(epoll_fd >= 0){
+		close(epoll_fd);
 	}
+	epoll_fd = -1;
+
+	free(managed);
+	managed = NULL;
+	nmanaged = 0;
 }
 
 static int usage(char* fn){
@@ -83,60 +258,44 @@ static int reload(char* file){
 int main(int argc, char** argv){
 	int rv = EXIT_FAILURE;
 
-	fd_set primary, secondary;
-	int max_fd, error;
-
 	if(argc < 2){
 		fprintf(stderr, "No configuration provided\n");
 		rv = usage(argv[0]);
 		goto bail;
 	}
 
+	if(core_init()){
+		goto bail;
+	}
+
 	if(reload(argv[1])){
 		rv = usage(argv[0]);
 		goto bail;
 	}
 
-	signal(SIGINT, signal_handler);
-	signal(SIGTERM, signal_handler);
-	signal(SIGCHLD, signal_handler);
-	signal(SIGHUP, signal_handler);
-	signal(SIGPIPE, SIG_IGN);
-	FD_ZERO(&primary);
-
 	fprintf(stderr, "%s now waiting for API clients\n", VERSION);
 	while(!shutdown_requested){
-		FD_ZERO(&secondary);
-		max_fd = -1;
+		if(x11_loop()){
+			goto bail;
+		}
 
-		//handle events on the primary set, gather new fds on secondary
-		if(api_loop(&primary, &secondary, &max_fd)){
+		//control loop after x11 loop due to initialization requirements within x11
+		if(control_loop()){
 			goto bail;
 		}
 
-		if(x11_loop(&primary, &secondary, &max_fd)){
+		//publish state changes to the API I/O thread
+		if(api_loop()){
 			goto bail;
 		}
 
-		//control loop after x11 loop due to initialization requirements within x11
-		if(control_loop(&primary, &secondary, &max_fd)){
+		if(core_wait()){
 			goto bail;
 		}
 
-		//select on secondary
-		error = pid_signaled ? 0 : select(max_fd + 1, &secondary, NULL, NULL, NULL);
-		if(error < 0){
-			if(errno == EINTR){
-				if(shutdown_requested){
-					fprintf(stderr, "Exiting cleanly\n");
-					break;
-				}
-				//FD_ZERO(&secondary);
-			}
-			else{
-				fprintf(stderr, "select() failed: %s\n", strerror(errno));
-				goto bail;
-			}
+		if(shutdown_requested){
+			fprintf(stderr, "Exiting cleanly\n");
+			break;
 		}
 
 		if(pid_signaled){
@@ -146,34 +305,19 @@ int main(int argc, char** argv){
 			if(child_reap()){
 				goto bail;
 			}
-			//FIXME somehow, after returning from a signal handler,
-			//some additional fds are set in secondary
-			//this causes the process to block on accept
-			//resetting the active fd set works around this
-			FD_ZERO(&secondary);
 		}
 
 		if(reload_requested){
-			if(reload_requested != 2){
-				//when returning from a signal handler
-				//flush old module fds
-				FD_ZERO(&secondary);
-			}
 			if(reload(argv[1])){
 				cleanup_all();
 			}
-			if(!reload_requested){
-				//discard old fd set after reload
-				FD_ZERO(&secondary);
-			}
 		}
-		//swap descriptor sets
-		primary = secondary;
 	}
 
 	rv = EXIT_SUCCESS;
 
 bail:
 	cleanup_all();
+	core_cleanup();
 	return rv;
 }
@@ -1,5 +1,24 @@
+#ifndef RPCD_CORE_H
+#define RPCD_CORE_H
 #include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
 
 extern volatile sig_atomic_t shutdown_requested;
 
 #define VERSION "rpcd 1.0"
+#define CORE_MAX_EVENTS 64
+
+//callback invoked by the core loop for ready fds, token is passed through from registration
+typedef int (*core_callback)(int fd, uint32_t events, size_t token);
+
+typedef struct /*_core_managed_fd_t*/ {
+	core_callback handler;
+	size_t token;
+	uint32_t events;
+} managed_fd_t;
+
+int core_manage_fd(int fd, uint32_t events, core_callback handler, size_t token);
+int core_update_fd(int fd, uint32_t events);
+int core_unmanage_fd(int fd);
+#endif
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "websocket.h"
+
+#define SHA1_ROTATE(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
+
+static void websocket_sha1_block(uint32_t* state, uint8_t* block){
+	uint32_t w[80], a, b, c, d, e, f, k, temp;
+	size_t u;
+
+	for(u = 0; u < 16; u++){
+		w[u] = ((uint32_t) block[u * 4] << 24) | (block[u * 4 + 1] << 16) | (block[u * 4 + 2] << 8) | block[u * 4 + 3];
+	}
+	for(; u < 80; u++){
+		w[u] = SHA1_ROTATE(w[u - 3] ^ w[u - 8] ^ w[u - 14] ^ w[u - 16], 1);
+	}
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
+
+	for(u = 0; u < 80; u++){
+		if(u < 20){
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		}
+		else if(u < 40){
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		}
+		else if(u < 60){
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		}
+		else{
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+
+		temp = SHA1_ROTATE(a, 5) + f + e + k + w[u];
+		e = d;
+		d = c;
+		c = SHA1_ROTATE(b, 30);
+		b = a;
+		a = temp;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+}
+
+static void websocket_sha1(uint8_t* data, size_t length, uint8_t* digest){
+	uint32_t state[5] = {
+		0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+	};
+	uint8_t block[64];
+	uint64_t bits = (uint64_t) length * 8;
+	size_t u, offset;
+
+	for(offset = 0; offset + 64 <= length; offset += 64){
+		websocket_sha1_block(state, data + offset);
+	}
+
+	//pad the remainder with a single set bit and the message length in bits
+	memset(block, 0, sizeof(block));
+	memcpy(block, data + offset, length - offset);
+	block[length - offset] = 0x80;
+	if(length - offset >= 56){
+		websocket_sha1_block(state, block);
+		memset(block, 0, sizeof(block));
+	}
+	for(u = 0; u < 8; u++){
+		block[63 - u] = bits >> (u * 8);
+	}
+	websocket_sha1_block(state, block);
+
+	for(u = 0; u < 20; u++){
+		digest[u] = state[u / 4] >> (24 - (u % 4) * 8);
+	}
+}
+
+int websocket_accept_key(char* key, char* accept){
+	char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char input[64 + sizeof(WEBSOCKET_GUID)];
+	uint8_t digest[21] = "";
+	size_t u, off = 0;
+
+	//the key is a base64 encoded 16 byte nonce
+	if(strlen(key) != 24){
+		fprintf(stderr, "Invalid WebSocket key: %s\n", key);
+		return 1;
+	}
+
+	snprintf(input, sizeof(input), "%s%s", key, WEBSOCKET_GUID);
+	websocket_sha1((uint8_t*) input, strlen(input), digest);
+
+	//base64 encode the digest, padding the final two-byte group
+	for(u = 0; u < 20; u += 3){
+		accept[off++] = alphabet[digest[u] >> 2];
+		accept[off++] = alphabet[((digest[u] & 0x03) << 4) | (digest[u + 1] >> 4)];
+		if(u + 2 < 20){
+			accept[off++] = alphabet[((digest[u + 1] & 0x0F) << 2) | (digest[u + 2] >> 6)];
+			accept[off++] = alphabet[digest[u + 2] & 0x3F];
+		}
+		else{
+			accept[off++] = alphabet[(digest[u + 1] & 0x0F) << 2];
+			accept[off++] = '=';
+		}
+	}
+	accept[off] = 0;
+	return 0;
+}
+
+ssize_t websocket_parse_frame(uint8_t* data, size_t length, websocket_frame_t* frame){
+	size_t u, header = 2;
+	uint8_t* mask = NULL;
+
+	if(length < header){
+		return 0;
+	}
+
+	frame->fin = (data[0] & 0x80) ? 1 : 0;
+	frame->opcode = data[0] & 0x0F;
+	frame->payload_length = data[1] & 0x7F;
+
+	//reserved bits signal unnegotiated extensions, clients must mask their frames
+	if((data[0] & 0x70) || !(data[1] & 0x80)){
+		return -1;
+	}
+
+	//control frames may not be fragmented and carry at most 125 bytes
+	if((frame->opcode & 0x08) && (!frame->fin || frame->payload_length > 125)){
+		return -1;
+	}
+
+	if(frame->payload_length == 126){
+		header += 2;
+	}
+	else if(frame->payload_length == 127){
+		header += 8;
+	}
+
+	if(length < header + 4){
+		return 0;
+	}
+
+	if(frame->payload_length == 126){
+		frame->payload_length = (data[2] << 8) | data[3];
+	}
+	else if(frame->payload_length == 127){
+		for(frame->payload_length = 0, u = 2; u < 10; u++){
+			frame->payload_length = (frame->payload_length << 8) | data[u];
+		}
+	}
+
+	mask = data + header;
+	header += 4;
+	frame->header_length = header;
+
+	if(length - header < frame->payload_length){
+		return 0;
+	}
+
+	//unmask payload in place
+	for(u = 0; u < frame->payload_length; u++){
+		data[header + u] ^= mask[u % 4];
+	}
+
+	return header + frame->payload_length;
+}
+
+size_t websocket_frame_header(uint8_t* out, websocket_opcode_t opcode, size_t length){
+	size_t u;
+
+	//server frames are always final and never masked
+	out[0] = 0x80 | opcode;
+	if(length < 126){
+		out[1] = length;
+		return 2;
+	}
+	else if(length <= 0xFFFF){
+		out[1] = 126;
+		out[2] = length >> 8;
+		out[3] = length & 0xFF;
+		return 4;
+	}
+
+	out[1] = 127;
+	for(u = 0; u < 8; u++){
+		out[9 - u] = (length >> (u * 8)) & 0xFF;
+	}
+	return 10;
+}
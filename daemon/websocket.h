@@ -0,0 +1,31 @@
+#ifndef RPCD_WEBSOCKET_H
+#define RPCD_WEBSOCKET_H
+#include <stdint.h>
+#include <sys/types.h>
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WEBSOCKET_VERSION "13"
+//base64 of a SHA-1 digest plus terminator
+#define WEBSOCKET_ACCEPT_LENGTH 29
+#define WEBSOCKET_HEADER_MAX 14
+
+typedef enum /*_websocket_opcode_t*/ {
+	ws_continuation = 0,
+	ws_text = 1,
+	ws_binary = 2,
+	ws_close = 8,
+	ws_ping = 9,
+	ws_pong = 10
+} websocket_opcode_t;
+
+typedef struct /*_websocket_frame_t*/ {
+	int fin;
+	websocket_opcode_t opcode;
+	size_t header_length;
+	size_t payload_length;
+} websocket_frame_t;
+
+int websocket_accept_key(char* key, char* accept);
+ssize_t websocket_parse_frame(uint8_t* data, size_t length, websocket_frame_t* frame);
+size_t websocket_frame_header(uint8_t* out, websocket_opcode_t opcode, size_t length);
+#endif
@@ -1,11 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
 
+#include "rpcd.h"
+#include "metrics.h"
 #include "x11.h"
 #include "control.h"
 #include "child.h"
+#include "api.h"
 
 static int init_done = 0;
 
@@ -13,6 +15,7 @@ static size_t ndisplays = 0;
 static display_t* displays = NULL;
 static size_t nwindows = 0;
 static tracked_window_t* windows = NULL;
+static metric_t* round_trip = NULL;
 
 size_t x11_count(){
 	return ndisplays;
@@ -38,73 +41,121 @@ size_t x11_find_id(char* name){
 	return 0;
 }
 
-static int x11_handle_window(display_t* display, Window w){
-	char* window_title = NULL;
-	int pid_format = 0, rv = 0;
-	unsigned long pid_items = 0, bytes_left = 0;
-	Atom pid_type;
-	XClassHint class_hints = {
-		0
-	};
-	pid_t* pid = NULL;
-
-	if(XGetWindowProperty(display->display_handle, w, display->net_wm_pid,
-			0, sizeof(pid) / 4, False, XA_CARDINAL,
-			&pid_type, &pid_format, &pid_items, &bytes_left,
-			(unsigned char**) &pid) != Success || pid_type != XA_CARDINAL){
-		//this should not have changed, but set it anyway
-		pid = NULL;
-		fprintf(stderr, "Failed to fetch PID for window %zu\n", w);
-	}
-	else if(bytes_left || pid_items != 1 || pid_format != 32){
-		fprintf(stderr, "PID not in expected format, %zu bytes and %zu items left, format %d\n", bytes_left, pid_items, pid_format);
-		if(pid){
-			XFree(pid);
-			pid = NULL;
-		}
-	}
+static void x11_query_window(display_t* display, tracked_window_t* window){
+	//all properties are requested at once, the replies are collected after the current burst of events
+	window->pid = xcb_get_property(display->connection, 0, window->window, display->net_wm_pid, XCB_ATOM_CARDINAL, 0, 1);
+	window->title = xcb_get_property(display->connection, 0, window->window, XCB_ATOM_WM_NAME, XCB_GET_PROPERTY_TYPE_ANY, 0, DATA_CHUNK);
+	window->class = xcb_get_property(display->connection, 0, window->window, XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 0, DATA_CHUNK);
+	window->state = pending;
+	display->pending_windows++;
+}
 
-	if(!XFetchName(display->display_handle, w, &window_title)){
-		fprintf(stderr, "Failed to fetch window title for window %zu\n", w);
-		window_title = NULL;
-	}
+static char* x11_property_string(xcb_get_property_reply_t* reply, size_t offset){
+	size_t length = reply ? xcb_get_property_value_length(reply) : 0;
 
-	if(!XGetClassHint(display->display_handle, w, &class_hints)){
-		fprintf(stderr, "Failed to fetch window class hints for window %zu\n", w);
+	if(offset >= length){
+		return NULL;
 	}
 
-	rv = child_match_window(display - displays, w, pid ? *pid : 0, window_title, class_hints.res_name, class_hints.res_class);
+	return strndup((char*) xcb_get_property_value(reply) + offset, length - offset);
+}
+
+static int x11_handle_window(display_t* display, tracked_window_t* window){
+	char *window_title = NULL, *res_name = NULL, *res_class = NULL;
+	xcb_get_property_reply_t *pid = NULL, *title = NULL, *class = NULL;
+	xcb_generic_error_t* error = NULL;
+	pid_t window_pid = 0;
+	int rv = 0;
+
+	window->state = active;
+	display->pending_windows--;
+
+	pid = xcb_get_property_reply(display->connection, window->pid, &error);
+	if(!pid || pid->type != XCB_ATOM_CARDINAL){
+		fprintf(stderr, "Failed to fetch PID for window %u\n", window->window);
+	}
+	else if(pid->bytes_after || pid->value_len != 1 || pid->format != 32){
+		fprintf(stderr, "PID not in expected format, %u bytes and %u items left, format %d\n", pid->bytes_after, pid->value_len, pid->format);
+	}
+	else{
+		window_pid = *((uint32_t*) xcb_get_property_value(pid));
+	}
+	free(error);
 
-	if(pid){
-		XFree(pid);
+	title = xcb_get_property_reply(display->connection, window->title, NULL);
+	window_title = x11_property_string(title, 0);
+	if(!window_title){
+		fprintf(stderr, "Failed to fetch window title for window %u\n", window->window);
 	}
-	if(window_title){
-		XFree(window_title);
+
+	//WM_CLASS holds the instance name and the class name, both terminated
+	class = xcb_get_property_reply(display->connection, window->class, NULL);
+	res_name = x11_property_string(class, 0);
+	if(!res_name){
+		fprintf(stderr, "Failed to fetch window class hints for window %u\n", window->window);
 	}
-	if(class_hints.res_name){
-		XFree(class_hints.res_name);
+	else{
+		res_class = x11_property_string(class, strlen(res_name) + 1);
 	}
-	if(class_hints.res_class){
-		XFree(class_hints.res_class);
+
+	rv = child_match_window(display - displays, window->window, window_pid, window_title, res_name, res_class);
+
+	free(pid);
+	free(title);
+	free(class);
+	free(window_title);
+	free(res_name);
+	free(res_class);
+	return rv;
+}
+
+static int x11_resolve_windows(display_t* display){
+	size_t u;
+	int rv = 0;
+
+	for(u = 0; u < nwindows && display->pending_windows; u++){
+		if(windows[u].state == pending && windows[u].display_id == display - displays){
+			rv |= x11_handle_window(display, windows + u);
+		}
 	}
 	return rv;
 }
 
-static int x11_handle_event(display_t* display, XEvent* ev){
+static int x11_request_done(display_t* display, xcb_window_t window);
+static int x11_request_finish(display_t* display);
+
+static int x11_handle_event(display_t* display, xcb_generic_event_t* ev){
+	xcb_property_notify_event_t* property = (xcb_property_notify_event_t*) ev;
+	xcb_configure_notify_event_t* configure = (xcb_configure_notify_event_t*) ev;
+	xcb_create_notify_event_t* create = (xcb_create_notify_event_t*) ev;
+	xcb_destroy_notify_event_t* destroy = (xcb_destroy_notify_event_t*) ev;
+	xcb_generic_error_t* error = (xcb_generic_error_t*) ev;
 	size_t u;
-	switch(ev->type){
-		case ConfigureNotify:
+
+	switch(ev->response_type & ~0x80){
+		case 0:
+			//errors are reported here instead of terminating the daemon, mostly windows that vanished while being queried
+			fprintf(stderr, "X error %d on display %s for resource %u, request %d.%d\n", error->error_code, display->identifier,
+					error->resource_id, error->major_code, error->minor_code);
+			break;
+		case XCB_PROPERTY_NOTIFY:
+			//ratpoison signals the completion of a command by setting the result on its request window
+			if(property->atom == display->rp_command_result && property->state == XCB_PROPERTY_NEW_VALUE){
+				return x11_request_done(display, property->window);
+			}
+			break;
+		case XCB_CONFIGURE_NOTIFY:
 			//on first configure: gather matching info and pass to command module
 			//using configure instead of map as there is a race condition between telling
 			//ratpoison to map a window to a frame and that window actually becoming exposed
 			for(u = 0; u < nwindows; u++){
-				if(windows[u].window == ev->xmap.window && windows[u].state == unconfigured){
-					windows[u].state = active;
-					return x11_handle_window(display, ev->xmap.window);
+				if(windows[u].window == configure->window && windows[u].state == unconfigured){
+					x11_query_window(display, windows + u);
+					return 0;
 				}
 			}
 			break;
-		case CreateNotify:
+		case XCB_CREATE_NOTIFY:
 			//add to set of tracked windows
 			for(u = 0; u < nwindows; u++){
 				if(windows[u].state == inactive){
@@ -124,83 +175,77 @@ static int x11_handle_event(display_t* display, XEvent* ev){
 			}
 
 			windows[u].state = unconfigured;
-			windows[u].window = ev->xcreatewindow.window;
+			windows[u].window = create->window;
+			windows[u].display_id = display - displays;
 			return 0;
-		case DestroyNotify:
+		case XCB_DESTROY_NOTIFY:
+			//windows still being queried are matched first, so they can be discarded in order
+			if(display->pending_windows && x11_resolve_windows(display)){
+				return 1;
+			}
+
 			//remove from tracking set, notify command if configured
 			for(u = 0; u < nwindows; u++){
-				if(windows[u].window == ev->xdestroywindow.window){
+				if(windows[u].window == destroy->window){
 					if(windows[u].state == active){
-						child_discard_window(display - displays, ev->xdestroywindow.window);
+						child_discard_window(display - displays, destroy->window);
 					}
 					windows[u].state = inactive;
 					return 0;
 				}
 			}
-			fprintf(stderr, "Untracked window %zu destroyed on display %s\n", ev->xdestroywindow.window, display->identifier);
+			fprintf(stderr, "Untracked window %u destroyed on display %s\n", destroy->window, display->identifier);
 	}
 	return 0;
 }
 
-static void x11_connection_watch(Display* dpy, XPointer data, int fd, Bool opening, XPointer* watch_data){
-	size_t u;
-	display_t* display = NULL;
+static int x11_process(display_t* display, int queued){
+	xcb_generic_event_t* ev = NULL;
+	int rv = 0;
 
-	if(!data){
-		fprintf(stderr, "x11_connection_watch called with invalid display data\n");
-		return;
+	//queued events were read while waiting for replies, these are not signalled by the core loop
+	while(!rv && (ev = queued ? xcb_poll_for_queued_event(display->connection) : xcb_poll_for_event(display->connection))){
+		rv = x11_handle_event(display, ev);
+		free(ev);
 	}
 
-	display = (display_t*) data;
-
-	for(u = 0; u < display->nfds; u++){
-		if(display->fds[u] == fd){
-			if(!opening){
-				display->fds[u] = -1;
-			}
-			return;
-		}
-
-		//this might cause an fd to appear multiple times, but we do not actually care
-		if(opening && display->fds[u] == -1){
-			display->fds[u] = fd;
-			return;
-		}
+	if(xcb_connection_has_error(display->connection)){
+		fprintf(stderr, "Lost connection to display %s\n", display->identifier);
+		return 1;
 	}
 
-	display->fds = realloc(display->fds, (display->nfds + 1) * sizeof(int));
-	if(!display->fds){
-		fprintf(stderr, "Failed to allocate memory\n");
-		display->nfds = 0;
-		return;
+	//replies for the whole burst of events are collected together
+	if(!rv && display->pending_windows){
+		rv = x11_resolve_windows(display);
 	}
 
-	display->fds[display->nfds] = fd;
-	display->nfds++;
+	rv |= x11_request_finish(display);
+	xcb_flush(display->connection);
+	return rv;
 }
 
-//See ratpoison:src/communications.c for the original implementation of the ratpoison
-//command protocol
-static int x11_fetch_response(display_t* display, Window w, char** response){
-	int format, rv = -1;
-	unsigned long items, bytes;
-	unsigned char* result = NULL;
-	Atom type;
-
-	if(XGetWindowProperty(display->display_handle, w, display->rp_command_result,
-				0, 0, False, XA_STRING,
-				&type, &format, &items, &bytes, &result) != Success
-			|| !result){
-		fprintf(stderr, "Failed to fetch ratpoison command result status\n");
-		goto bail;
+static int x11_event(int fd, uint32_t events, size_t token){
+	display_t* display = x11_get(token);
+
+	if(!display || !display->connection){
+		fprintf(stderr, "Event for invalid display %zu\n", token);
+		return 0;
 	}
 
-	XFree(result);
+	return x11_process(display, 0);
+}
 
-	if(XGetWindowProperty(display->display_handle, w, display->rp_command_result,
-				0, (bytes / 4) + ((bytes % 4) ? 1 : 0), True, XA_STRING,
-				&type, &format, &items, &bytes, &result) != Success
-			|| !result){
+//See ratpoison:src/communications.c for the original implementation of the ratpoison
+//command protocol
+static int x11_fetch_response(display_t* display, xcb_get_property_cookie_t cookie, char** response){
+	xcb_get_property_reply_t* reply = NULL;
+	char* result = NULL;
+	int rv = -1;
+
+	//the result was requested in full and deleted in the same request
+	reply = xcb_get_property_reply(display->connection, cookie, NULL);
+	result = x11_property_string(reply, 0);
+	if(!result){
 		fprintf(stderr, "Failed to fetch ratpoison command result\n");
 		goto bail;
 	}
@@ -214,7 +259,7 @@ static int x11_fetch_response(display_t* display, Window w, char** response){
 
 		//command ok
 		if(*result == '1'){
-			*response = strdup((char*) (result + 1));
+			*response = strdup(result + 1);
 			if(!*response){
 				fprintf(stderr, "Failed to allocate memory\n");
 			}
@@ -223,59 +268,190 @@ static int x11_fetch_response(display_t* display, Window w, char** response){
 
 	rv = 0;
 bail:
-	if(result){
-		XFree(result);
+	free(result);
+	free(reply);
+	return rv;
+}
+
+static int x11_request_send(display_t* display){
+	//ratpoison reads the request list as Xlib Window values
+	unsigned long request_window = display->rp_window;
+	rp_request_t* request = NULL;
+	size_t u;
+
+	//ratpoison only consumes the first window of the request list,
+	//so the request window carries one command at a time
+	if(display->request_sent){
+		return 0;
+	}
+
+	//completed requests may still wait for their results
+	for(u = 0; u < display->nrequests && display->requests[u].done; u++){
+	}
+
+	if(u == display->nrequests){
+		return 0;
+	}
+
+	if(!round_trip){
+		round_trip = metrics_register(metric_histogram, "rpcd_ratpoison_command_seconds", "Round trip time of ratpoison commands", NULL);
+	}
+
+	request = display->requests + u;
+	display->request_started = metrics_time();
+	xcb_change_property(display->connection, XCB_PROP_MODE_REPLACE, display->rp_window, display->rp_command, XCB_ATOM_STRING, 8, request->length, request->command);
+	xcb_change_property(display->connection, XCB_PROP_MODE_APPEND, display->root, display->rp_command_request, XCB_ATOM_WINDOW, 8, sizeof(unsigned long), &request_window);
+	xcb_flush(display->connection);
+	display->request_sent = 1;
+	return 0;
+}
+
+static int x11_request_complete(display_t* display){
+	rp_request_t request = display->requests[0];
+	char* response = NULL;
+	int rv = 0;
+
+	if(request.fetching){
+		x11_fetch_response(display, request.result, &response);
+	}
+
+	display->nrequests--;
+	memmove(display->requests, display->requests + 1, display->nrequests * sizeof(rp_request_t));
+	display->requests_done++;
+
+	if(request.callback){
+		rv |= request.callback(display - displays, response, request.token);
+	}
+
+	if(request.response){
+		*request.response = response;
+	}
+	else{
+		free(response);
+	}
+
+	if(!request.borrowed){
+		free(request.command);
 	}
 	return rv;
 }
 
-static int x11_run_command(display_t* display, char* command, char** response){
-	int rv = 1;
-	XEvent ev;
+static int x11_request_done(display_t* display, xcb_window_t window){
+	size_t u;
 
-	if(!display){
-		fprintf(stderr, "Invalid display passed to x11_run_command\n");
-		return 1;
+	if(window != display->rp_window || !display->request_sent){
+		return 0;
 	}
 
-	Window root = DefaultRootWindow(display->display_handle);
-	Window w = XCreateSimpleWindow(display->display_handle, root, 0, 0, 1, 1, 0, 0, 0);
-	char* command_string = calloc(strlen(command) + 2, sizeof(char));
+	for(u = 0; display->requests[u].done; u++){
+	}
 
-	if(!command_string){
-		fprintf(stderr, "Failed to allocate memory\n");
-		goto bail;
+	metrics_observe(round_trip, metrics_time() - display->request_started);
+	display->requests[u].done = 1;
+	display->request_sent = 0;
+
+	//the result property is removed either way, so the next result is signalled again.
+	//the server handles the removal before the next command sent on this connection,
+	//the reply is collected after the current burst of events
+	if(display->requests[u].response || display->requests[u].callback){
+		display->requests[u].result = xcb_get_property(display->connection, 1, window, display->rp_command_result, XCB_ATOM_STRING, 0, UINT32_MAX / 4);
+		display->requests[u].fetching = 1;
+	}
+	else{
+		xcb_delete_property(display->connection, window, display->rp_command_result);
+	}
+
+	return x11_request_send(display);
+}
+
+static int x11_request_finish(display_t* display){
+	int rv = 0;
+
+	//results are handled in submission order
+	while(display->nrequests && display->requests[0].done){
+		rv |= x11_request_complete(display);
 	}
+	return rv;
+}
 
+static int x11_request_queue(display_t* display, rp_request_t* request){
 	if(!display->rp_command
 			|| !display->rp_command_request
 			|| !display->rp_command_result){
-		fprintf(stderr, "Window manager interaction disabled on %s, would have run: %s\n", display->name, command);
-		rv = 0;
-		goto bail;
+		fprintf(stderr, "Window manager interaction disabled on %s, would have run: %s\n", display->name, request->command + 1);
+		if(!request->borrowed){
+			free(request->command);
+		}
+		return request->callback ? request->callback(display - displays, NULL, request->token) : 0;
 	}
 
-	memcpy(command_string + 1, command, strlen(command));
+	if(display->nrequests == display->requests_alloc){
+		display->requests = realloc(display->requests, (display->requests_alloc + 1) * sizeof(rp_request_t));
+		if(!display->requests){
+			fprintf(stderr, "Failed to allocate memory\n");
+			display->nrequests = display->requests_alloc = 0;
+			return 1;
+		}
+		display->requests_alloc++;
+	}
 
-	XSelectInput(display->display_handle, w, PropertyChangeMask);
-	XChangeProperty(display->display_handle, w, display->rp_command, XA_STRING, 8, PropModeReplace, (unsigned char*) command_string, strlen(command) + 2);
-	XChangeProperty(display->display_handle, root, display->rp_command_request, XA_WINDOW, 8, PropModeAppend, (unsigned char*) &w, sizeof(Window));
+	request->done = 0;
+	request->fetching = 0;
+	display->requests[display->nrequests] = *request;
+	display->nrequests++;
+	display->requests_queued++;
 
-	for(;;){
-		XMaskEvent(display->display_handle, PropertyChangeMask, &ev);
-		if(ev.xproperty.atom == display->rp_command_result && ev.xproperty.state == PropertyNewValue){
-			rv = 0;
-			if(response){
-				rv = x11_fetch_response(display, w, response);
-			}
-			break;
-		}
+	//results are handled by the core loop as the result property changes
+	return x11_request_send(display);
+}
+
+static int x11_run_command(display_t* display, char* command, char** response, x11_completion callback, size_t token){
+	rp_request_t request = {
+		.length = strlen(command) + 2,
+		.response = response,
+		.callback = callback,
+		.token = token
+	};
+
+	if(!display){
+		fprintf(stderr, "Invalid display passed to x11_run_command\n");
+		return 1;
 	}
 
-bail:
-	free(command_string);
-	XDestroyWindow(display->display_handle, w);
-  	return rv;
+	request.command = calloc(request.length, sizeof(char));
+	if(!request.command){
+		fprintf(stderr, "Failed to allocate memory\n");
+		return 1;
+	}
+
+	memcpy(request.command + 1, command, strlen(command));
+	return x11_request_queue(display, &request);
+}
+
+//blocks until the command completed, only used while loading the configuration
+static int x11_run_blocking(display_t* display, char* command, char** response){
+	xcb_generic_event_t* ev = NULL;
+	size_t request;
+	int rv;
+
+	if(x11_run_command(display, command, response, NULL, 0)){
+		return 1;
+	}
+
+	for(request = display->requests_queued; display->requests_done < request;){
+		ev = xcb_wait_for_event(display->connection);
+		if(!ev){
+			fprintf(stderr, "Lost connection to display %s\n", display->identifier);
+			return 1;
+		}
+
+		rv = x11_handle_event(display, ev);
+		free(ev);
+		if(rv || x11_request_finish(display)){
+			return 1;
+		}
+	}
+	return 0;
 }
 
 static int x11_repatriate(size_t display_id){
@@ -308,7 +484,25 @@ bail:
 	return rv;
 }
 
+
 static void x11_display_free(display_t* display){
+	size_t u;
+
+	//queued commands are dropped without completion
+	for(u = 0; u < display->nrequests; u++){
+		if(!display->requests[u].borrowed){
+			free(display->requests[u].command);
+		}
+	}
+	free(display->requests);
+	display->requests = NULL;
+	display->nrequests = display->requests_alloc = 0;
+	display->request_sent = 0;
+
+	if(display->fd >= 0){
+		core_unmanage_fd(display->fd);
+	}
+
 	free(display->name);
 	display->name = NULL;
 
@@ -318,12 +512,17 @@ static void x11_display_free(display_t* display){
 	free(display->default_layout_name);
 	display->default_layout_name = NULL;
 
-	if(display->display_handle){
-		XCloseDisplay(display->display_handle);
-	}
+	display->applied_layout = NULL;
 
-	display->nfds = 0;
-	free(display->fds);
+	if(display->connection){
+		if(display->rp_window){
+			xcb_destroy_window(display->connection, display->rp_window);
+		}
+		xcb_disconnect(display->connection);
+		display->connection = NULL;
+	}
+	display->rp_window = 0;
+	display->fd = -1;
 }
 
 static int x11_display_init(display_t* display, char* name){
@@ -332,12 +531,13 @@ static int x11_display_init(display_t* display, char* name){
 	};
 
 	*display = empty;
+	display->fd = -1;
 	display->name = strdup(name);
 	return display->name ? 0 : 1;
 }
 
 int x11_fetch_layout(size_t display_id, char** layout){
-	return x11_run_command(x11_get(display_id), "sfdump", layout);
+	return x11_run_blocking(x11_get(display_id), "sfdump", layout);
 }
 
 void x11_lock(size_t display_id){
@@ -361,57 +561,77 @@ void x11_unlock(size_t display_id){
 	}
 }
 
+static int x11_layout_applied(display_t* display, layout_t* layout){
+	size_t frame;
+
+	if(display->damaged || display->applied_layout != layout){
+		return 0;
+	}
+
+	//the template slots hold the windows of the last restore sent for this layout
+	for(frame = 0; frame < layout->nframes; frame++){
+		if(layout->windows[frame] != child_window(layout->display_id, layout->frames[frame].id)){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int x11_layout_restored(size_t display_id, char* response, size_t token){
+	display_t* display = x11_get(display_id);
+	layout_t* layout = layout_get(token);
+
+	if(!response){
+		fprintf(stderr, "Failed to restore layout %s on display %s\n", layout->name, display->name);
+		return 0;
+	}
+
+	//only the latest restore counts, and only if no command changed the frameset since it was queued
+	if(!display->damaged && display->requests_done == display->restore_request){
+		display->applied_layout = layout;
+	}
+	return 0;
+}
+
 int x11_activate_layout(layout_t* layout){
-	size_t left = 0, frame = 0, off = 10;
+	size_t frame;
 	display_t* display = x11_get(layout->display_id);
-	char* layout_string = strdup("sfrestore ");
-	ssize_t required = 0;
+	rp_request_t request = {
+		.command = layout->restore,
+		.length = layout->restore_length,
+		.borrowed = 1,
+		.callback = x11_layout_restored,
+		.token = layout - layout_get(0)
+	};
 	int rv;
 
-	if(!layout_string || !display){
-		fprintf(stderr, "Failed to allocate memory\n");
-		free(layout_string);
+	if(!display){
+		fprintf(stderr, "Invalid display passed to x11_activate_layout\n");
 		return 1;
 	}
 
-	for(frame = 0; frame < layout->nframes; frame++){
-		required = snprintf(layout_string + off, left, "%s(frame :number %zu :x %zu :y %zu :width %zu :height %zu :screenw %zu :screenh %zu :window %zu) %zu",
-				frame ? "," : "", layout->frames[frame].id,
-				layout->frames[frame].bbox[0], layout->frames[frame].bbox[1],
-				layout->frames[frame].bbox[2], layout->frames[frame].bbox[3],
-				layout->frames[frame].screen[0], layout->frames[frame].screen[1],
-				child_window(layout->display_id, layout->frames[frame].id),
-				layout->frames[frame].screen[2]);
-
-		if(required < 0){
-			fprintf(stderr, "Failed to design layout string for %s on %s\n", layout->name, display->name);
-			rv = 1;
-			goto bail;
-		}
+	//nothing to do if ratpoison already shows the same windows in the same frames
+	if(x11_layout_applied(display, layout)){
+		display->current_layout = layout;
+		return 0;
+	}
 
-		if(required > left){
-			layout_string = realloc(layout_string, (strlen(layout_string) + 1 + DATA_CHUNK) * sizeof(char));
-			if(!layout_string){
-				fprintf(stderr, "Failed to allocate memory\n");
-				rv = 1;
-				goto bail;
-			}
+	//the applied state is unknown until ratpoison confirmed the new layout
+	display->applied_layout = NULL;
+	display->damaged = 0;
 
-			left = DATA_CHUNK;
-			frame--;
-			continue;
-		}
-
-		off += required;
-		left -= required;
+	//only the window slots of the precompiled restore command change, the queued
+	//request points into the template, so a later activation updates it in place
+	for(frame = 0; frame < layout->nframes; frame++){
+		layout_set_window(layout, frame, child_window(layout->display_id, layout->frames[frame].id));
 	}
 
-	rv = x11_run_command(display, layout_string, NULL);
+	rv = x11_request_queue(display, &request);
+	display->restore_request = display->requests_queued;
 	display->current_layout = layout;
+	api_event("layout", "{\"display\":\"%s\",\"layout\":\"%s\"}", display->name, layout->name);
 	//stop commands from undoing the layout change
 	child_discard_restores(layout->display_id);
-bail:
-	free(layout_string);
 	return rv;
 }
 
@@ -424,18 +644,28 @@ int x11_default_layout(size_t display_id){
 	return 0;
 }
 
+void x11_damage(size_t display_id){
+	display_t* display = x11_get(display_id);
+
+	if(display){
+		display->damaged = 1;
+	}
+}
+
 int x11_fullscreen(size_t display_id){
-	return x11_run_command(x11_get(display_id), "only", NULL);
+	x11_damage(display_id);
+	return x11_run_command(x11_get(display_id), "only", NULL, NULL, 0);
 }
 
 int x11_rollback(size_t display_id){
-	return x11_run_command(x11_get(display_id), "undo", NULL);
+	x11_damage(display_id);
+	return x11_run_command(x11_get(display_id), "undo", NULL, NULL, 0);
 }
 
 int x11_select_frame(size_t display_id, size_t frame_id){
 	char command_buffer[DATA_CHUNK];
 	snprintf(command_buffer, sizeof(command_buffer), "fselect %zu", frame_id);
-	return x11_run_command(x11_get(display_id), command_buffer, NULL);
+	return x11_run_command(x11_get(display_id), command_buffer, NULL, NULL, 0);
 }
 
 layout_t* x11_current_layout(size_t display_id){
@@ -449,9 +679,8 @@ layout_t* x11_current_layout(size_t display_id){
 	return display->current_layout ? display->current_layout : display->default_layout;
 }
 
-int x11_loop(fd_set* in, fd_set* out, int* max_fd){
-	size_t u, p, mark;
-	XEvent ev;
+int x11_loop(){
+	size_t u;
 
 	if(!init_done){
 		for(u = 0; u < ndisplays; u++){
@@ -467,34 +696,11 @@ int x11_loop(fd_set* in, fd_set* out, int* max_fd){
 		init_done = 1;
 	}
 
+	//events may have been read into the queue while waiting for property replies,
+	//these would not be signaled by the core loop
 	for(u = 0; u < ndisplays; u++){
-		mark = 0;
-
-		//check if display data ready
-		for(p = 0; p < displays[u].nfds; p++){
-			if(displays[u].fds[p] >= 0 && FD_ISSET(displays[u].fds[p], in)){
-				XProcessInternalConnection(displays[u].display_handle, displays[u].fds[p]);
-				mark = 1;
-			}
-		}
-
-		//handle display events
-		if(mark){
-			while(XPending(displays[u].display_handle)){
-				XNextEvent(displays[u].display_handle, &ev);
-				if(x11_handle_event(displays + u, &ev)){
-					return 1;
-				}
-			}
-			XFlush(displays[u].display_handle);
-		}
-
-		//push all display fds to the core select loop
-		for(p = 0; p < displays[u].nfds; p++){
-			if(displays[u].fds[p] >= 0){
-				*max_fd = (*max_fd > displays[u].fds[p]) ? *max_fd : displays[u].fds[p];
-				FD_SET(displays[u].fds[p], out);
-			}
+		if(displays[u].connection && x11_process(displays + u, 1)){
+			return 1;
 		}
 	}
 	return 0;
@@ -530,6 +736,14 @@ int x11_new(char* name){
 
 int x11_config(char* option, char* value){
 	display_t* last = displays + (ndisplays - 1);
+	char* atom_names[] = {"RP_COMMAND", "RP_COMMAND_REQUEST", "RP_COMMAND_RESULT", "_NET_WM_PID"};
+	xcb_atom_t* atoms[] = {&last->rp_command, &last->rp_command_request, &last->rp_command_result, &last->net_wm_pid};
+	xcb_intern_atom_cookie_t atom_cookies[sizeof(atom_names) / sizeof(char*)];
+	xcb_intern_atom_reply_t* atom_reply = NULL;
+	uint32_t event_mask = XCB_EVENT_MASK_STRUCTURE_NOTIFY | XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY;
+	uint32_t request_mask = XCB_EVENT_MASK_PROPERTY_CHANGE;
+	xcb_screen_iterator_t roots;
+	int screen = 0;
 	size_t u;
 
 	if(!strcmp(option, "display")){
@@ -538,32 +752,35 @@ int x11_config(char* option, char* value){
 			return 1;
 		}
 
-		last->display_handle = XOpenDisplay(value);
-		if(!last->display_handle){
+		last->connection = xcb_connect(value, &screen);
+		if(xcb_connection_has_error(last->connection)){
 			fprintf(stderr, "Failed to open display %s\n", value);
+			xcb_disconnect(last->connection);
+			last->connection = NULL;
 			return 1;
 		}
 
-		//fetch ratpoison-specific atoms
-		last->rp_command = XInternAtom(last->display_handle, "RP_COMMAND", True);
-		last->rp_command_request = XInternAtom(last->display_handle, "RP_COMMAND_REQUEST", True);
-		last->rp_command_result = XInternAtom(last->display_handle, "RP_COMMAND_RESULT", True);
-		last->net_wm_pid = XInternAtom(last->display_handle, "_NET_WM_PID", True);
+		//fetch ratpoison-specific atoms, all requests are sent before waiting for the replies
+		for(u = 0; u < sizeof(atom_names) / sizeof(char*); u++){
+			atom_cookies[u] = xcb_intern_atom(last->connection, 1, strlen(atom_names[u]), atom_names[u]);
+		}
+		for(u = 0; u < sizeof(atom_names) / sizeof(char*); u++){
+			atom_reply = xcb_intern_atom_reply(last->connection, atom_cookies[u], NULL);
+			*atoms[u] = atom_reply ? atom_reply->atom : XCB_ATOM_NONE;
+			free(atom_reply);
+		}
 
 		//this might happen if rpcd is running in a non-ratpoison environment for some reason
-		if(last->net_wm_pid == None){
+		if(last->net_wm_pid == XCB_ATOM_NONE){
 			fprintf(stderr, "The current window manager does not seem to support the _NET_WM_PID protocol\n");
 			return 1;
 		}
 
-		//add connection watch function for fd updates
-		if(!XAddConnectionWatch(last->display_handle, x11_connection_watch, (XPointer) last)){
-			fprintf(stderr, "Failed to add X11 connection watch function\n");
+		//xcb uses a single connection fd
+		last->fd = xcb_get_file_descriptor(last->connection);
+		if(core_manage_fd(last->fd, EPOLLIN, x11_event, last - displays)){
 			return 1;
 		}
-		//add primary fd (according to the docs, the watch procedure is called immediately after registering,
-		//with all open fds. in practice, this does not seem to happen)
-		x11_connection_watch(last->display_handle, (XPointer) last, XConnectionNumber(last->display_handle), True, NULL);
 
 		//copy identifier for updating children's DISPLAY environment
 		last->identifier = strdup(value);
@@ -572,10 +789,20 @@ int x11_config(char* option, char* value){
 			return 1;
 		}
 
-		fprintf(stderr, "%d screens on display %s\n", XScreenCount(last->display_handle), value);
-		for(u = 0; u < XScreenCount(last->display_handle); u++){
-			XSelectInput(last->display_handle, XRootWindow(last->display_handle, u), StructureNotifyMask | SubstructureNotifyMask);
+		fprintf(stderr, "%d screens on display %s\n", xcb_setup_roots_length(xcb_get_setup(last->connection)), value);
+		for(roots = xcb_setup_roots_iterator(xcb_get_setup(last->connection)), u = 0; roots.rem; xcb_screen_next(&roots), u++){
+			//ratpoison listens for requests on the default root window
+			if(u == (size_t) screen){
+				last->root = roots.data->root;
+			}
+			xcb_change_window_attributes(last->connection, roots.data->root, XCB_CW_EVENT_MASK, &event_mask);
 		}
+
+		//all ratpoison commands are sent through this window, their results are signalled as property changes
+		last->rp_window = xcb_generate_id(last->connection);
+		xcb_create_window(last->connection, XCB_COPY_FROM_PARENT, last->rp_window, last->root,
+				0, 0, 1, 1, 0, XCB_WINDOW_CLASS_INPUT_OUTPUT, XCB_COPY_FROM_PARENT, XCB_CW_EVENT_MASK, &request_mask);
+		xcb_flush(last->connection);
 		return 0;
 	}
 	else if(!strcmp(option, "deflayout")){
@@ -605,7 +832,7 @@ int x11_ok(){
 
 	display_t* last = displays + (ndisplays - 1);
 
-	if(!last->display_handle || !last->identifier){
+	if(!last->connection || !last->identifier){
 		fprintf(stderr, "No display connected for %s\n", last->name);
 		return 1;
 	}
@@ -1,9 +1,6 @@
 #ifndef RPCD_DISPLAY_H
 #define RPCD_DISPLAY_H
-#include <sys/select.h>
-#include <X11/Xlib.h>
-#include <X11/Xutil.h>
-#include <X11/Xatom.h>
+#include <xcb/xcb.h>
 #include "layout.h"
 
 #define DATA_CHUNK 1024
@@ -11,32 +8,73 @@
 typedef enum {
 	inactive = 0,
 	unconfigured,
+	pending,
 	active
 } window_state_t;
 
 typedef struct {
-	Window window;
+	xcb_window_t window;
 	window_state_t state;
+	size_t display_id;
+
+	//property queries sent on the first configure, collected together with those of other new windows
+	xcb_get_property_cookie_t pid;
+	xcb_get_property_cookie_t title;
+	xcb_get_property_cookie_t class;
 } tracked_window_t;
 
+//completion of an asynchronous ratpoison command, the response is NULL if the command failed or none was received
+typedef int (*x11_completion)(size_t display_id, char* response, size_t token);
+
+typedef struct /*_x11_rp_request_t*/ {
+	char* command; /*RP_COMMAND data, prefixed with the interactive flag*/
+	size_t length;
+	int borrowed; /*command points into a layout template and is not freed*/
+	char** response; /*receives the response if set*/
+	x11_completion callback;
+	size_t token;
+
+	int done; /*result arrived*/
+	int fetching; /*result requested with the cookie below*/
+	xcb_get_property_cookie_t result;
+} rp_request_t;
+
 typedef struct /*_x11_display_t*/ {
 	layout_t* default_layout;
 	layout_t* current_layout;
 
+	//last layout ratpoison confirmed, the windows shown in its frames are kept in its template.
+	//commands changing the frameset behind its back mark it damaged
+	layout_t* applied_layout;
+	size_t restore_request;
+	int damaged;
+
 	char* name;
 	char* identifier;
 	char* default_layout_name;
 	size_t repatriate;
 	size_t busy;
 
-	Display* display_handle;
-	Atom rp_command;
-	Atom rp_command_request;
-	Atom rp_command_result;
-	Atom net_wm_pid;
+	xcb_connection_t* connection;
+	xcb_window_t root;
+	xcb_atom_t rp_command;
+	xcb_atom_t rp_command_request;
+	xcb_atom_t rp_command_result;
+	xcb_atom_t net_wm_pid;
+	size_t pending_windows;
+
+	//ratpoison commands are queued and sent one at a time through a reusable request window,
+	//the queue only grows so slots of completed requests are reused
+	xcb_window_t rp_window;
+	size_t nrequests;
+	size_t requests_alloc;
+	rp_request_t* requests;
+	int request_sent;
+	double request_started;
+	size_t requests_queued;
+	size_t requests_done;
 
-	size_t nfds;
-	int* fds;
+	int fd;
 } display_t;
 
 size_t x11_count();
@@ -45,6 +83,7 @@ size_t x11_find_id(char* name);
 
 int x11_default_layout(size_t display_id);
 int x11_activate_layout(layout_t* layout);
+void x11_damage(size_t display_id);
 int x11_fullscreen(size_t display_id);
 int x11_rollback(size_t display_id);
 int x11_select_frame(size_t display_id, size_t frame_id);
@@ -54,7 +93,7 @@ void x11_lock(size_t display_id);
 void x11_unlock(size_t display_id);
 
 int x11_new(char* name);
-int x11_loop(fd_set* in, fd_set* out, int* max_fd);
+int x11_loop();
 int x11_config(char* option, char* value);
 int x11_ok();
 void x11_cleanup();
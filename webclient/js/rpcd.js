@@ -14,6 +14,9 @@ class Controller {
 								reject(err);
 							}
 							break;
+						case 304:
+							resolve(null);
+							break;
 						case 400:
 							try {
 								var content = JSON.parse(request.responseText);
@@ -58,7 +61,7 @@ class Controller {
 	}
 
 	stopCommand(i) {
-		this.ajax(`${window.config.api}/stop/${this.commands[i].name}`, 'GET').then(
+		this.ajax(`${window.config.api}/stop/${encodeURIComponent(this.commands[i].name)}`, 'GET').then(
 			() => {
 				this.status('Command stopped');
 				this.getStatus();
@@ -139,10 +142,9 @@ class Controller {
 			return d.display === display;
 		});
 
-		this.ajax(`${window.config.api}/layout/${display}/${d.layouts[layout].name}`, 'GET').then(
+		this.ajax(`${window.config.api}/layout/${encodeURIComponent(display)}/${encodeURIComponent(d.layouts[layout].name)}`, 'GET').then(
 			() => {
 				this.status('Layout loaded successfully');
-				this.state.layout = layout;
 				this.getStatus();
 			},
 			(err) => {
@@ -198,7 +200,7 @@ class Controller {
 			options.display = values[0];
 		}
 
-		this.ajax(`${window.config.api}/command/${command.name}`, 'POST', options).then(
+		this.ajax(`${window.config.api}/command/${encodeURIComponent(command.name)}`, 'POST', options).then(
 		(ans) => {
 			this.status('Command started');
 			this.getStatus();
@@ -441,7 +443,7 @@ class Controller {
 
 		let cmd = e.dataTransfer.getData('cmd_name');
 
-		this.ajax(`${window.config.api}/move/${cmd}/${frame.id}`, 'GET')
+		this.ajax(`${window.config.api}/move/${encodeURIComponent(cmd)}/${frame.id}`, 'GET')
 			.then(() => {
 				this.status(`Moved command ${cmd} to frame ${frame.id}`);
 			},
@@ -451,13 +453,55 @@ class Controller {
 		});
 	}
 
+	watchStatus() {
+		// fall back to polling if the browser can not subscribe to state changes
+		if (!window.EventSource) {
+			setInterval(this.getStatus.bind(this), 5000);
+			return;
+		}
+
+		let events = new EventSource(`${window.config.api}/events`);
+		// coalesce bursts of events into a single delta request
+		let update = () => {
+			clearTimeout(this.statusTimer);
+			this.statusTimer = setTimeout(this.getStatus.bind(this, false), 100);
+		};
+		// refresh after (re-)connecting, changes may have been missed meanwhile
+		events.onopen = update;
+		['layout', 'start', 'stop', 'map', 'unmap', 'variable'].forEach((type) => {
+			events.addEventListener(type, update);
+		});
+	}
+
+	mergeStatus(delta) {
+		// deltas only carry the parts changed since the last generation
+		let layout = this.state.layout;
+		if (delta.layout) {
+			delta.layout.forEach((item) => {
+				let index = this.findIndexByKey(layout, 'display', item.display);
+				if (index < 0) {
+					layout.push(item);
+				} else {
+					layout[index] = item;
+				}
+			});
+		}
+		Object.assign(this.state, delta, {layout: layout});
+	}
+
 	getStatus(first) {
-		this.ajax(`${window.config.api}/status`, 'GET')
-			.then((state) => {
-				this.state = state;
+		let since = this.state.generation ? `?since=${encodeURIComponent(this.state.generation)}` : '';
+		this.ajax(`${window.config.api}/status${since}`, 'GET')
+			.then((delta) => {
+				// not modified
+				if (!delta) {
+					return;
+				}
+				this.mergeStatus(delta);
+				let state = this.state;
 				this.fillFrameBox();
 
-				if (state.running) {
+				if (delta.running) {
 					let run_cmds = document.querySelector('#running_commands');
 					run_cmds.innerHTML = '';
 					this.commands.forEach((elem, index) => {
@@ -497,6 +541,7 @@ class Controller {
 			layout: [],
 			running: [0]
 		};
+		this.statusTimer = null;
 
 		// dummies
 		let lp = new Promise((resolve, reject) => {
@@ -541,10 +586,10 @@ class Controller {
 
 		Promise.all([lp, cp]).then(() => {
 			this.getStatus(true);
-			setInterval(this.getStatus.bind(this), 5000);
+			this.watchStatus();
 		}, (err) => {
 			this.getStatus(true);
-			setInterval(this.getStatus.bind(this), 5000);
+			this.watchStatus();
 		});
 
 		switch (window.location.hash) {